@@ -0,0 +1,100 @@
+/* Copyright 2014 K2Informatics GmbH, Root Laengenbold, Switzerland
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "arena.h"
+
+#include <stdlib.h>
+
+THREAD_LOCAL arena * arena::current = NULL;
+
+arena::arena(void)
+{
+	head = NULL;
+	spare = NULL;
+	spares = 0;
+}
+
+arena::~arena(void)
+{
+	reset();
+	while (spare != NULL) {
+		block * b = spare->next;
+		::free(spare);
+		spare = b;
+	}
+}
+
+void arena::attach(arena * a)
+{
+	current = a;
+}
+
+void arena::reset(void)
+{
+	while (head != NULL) {
+		block * b = head->next;
+		if (spares < ARENA_KEEP) {
+			head->next = spare;
+			spare = head;
+			++spares;
+		} else
+			::free(head);
+		head = b;
+	}
+}
+
+arena::block * arena::add_block(void)
+{
+	block * b = spare;
+	if (b != NULL) {
+		spare = b->next;
+		--spares;
+	} else if (NULL == (b = (block *)malloc(sizeof(block) + ARENA_BLOCK)))
+		throw std::bad_alloc();
+	b->next = head;
+	b->used = 0;
+	head = b;
+	return b;
+}
+
+void * arena::alloc(size_t n)
+{
+	// header and size rounded up, keeps every allocation aligned
+	size_t need = sizeof(arena_hdr) + (n + sizeof(arena_hdr) - 1) / sizeof(arena_hdr) * sizeof(arena_hdr);
+	arena * a = current;
+	arena_hdr * h;
+	if (a == NULL || need > ARENA_BIG) {
+		if (NULL == (h = (arena_hdr *)malloc(sizeof(arena_hdr) + n)))
+			throw std::bad_alloc();
+		h->in_arena = false;
+	} else {
+		block * b = a->head;
+		if (b == NULL || b->used + need > ARENA_BLOCK)
+			b = a->add_block();
+		h = (arena_hdr *)((char *)(&b->align + 1) + b->used);
+		b->used += need;
+		h->in_arena = true;
+	}
+	return h + 1;
+}
+
+// arena memory goes with the next reset
+void arena::free(void * p)
+{
+	if (p == NULL)
+		return;
+	arena_hdr * h = (arena_hdr *)p - 1;
+	if (!h->in_arena)
+		::free(h);
+}
@@ -0,0 +1,98 @@
+/* Copyright 2014 K2Informatics GmbH, Root Laengenbold, Switzerland
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "platform.h"
+
+#include <new>
+
+#define ARENA_BLOCK		(64*1024)		// bytes per block
+#define ARENA_BIG		(ARENA_BLOCK/4)	// larger allocations go to the heap
+#define ARENA_KEEP		16				// blocks kept for the next command
+
+// in front of every allocation, tells free() where it came from
+typedef union arena_hdr {
+	bool in_arena;
+	double align_d;
+	long long align_ll;
+	void * align_p;
+} arena_hdr;
+
+// Monotonic memory of one worker, the terms of a command are bump
+// allocated from it and dropped all at once when the command is done.
+// Threads without an attached arena allocate from the heap.
+class arena
+{
+private:
+	typedef struct block {
+		struct block * next;
+		size_t used;
+		arena_hdr align;	// data follows
+	} block;
+	block * head;			// in use, newest first
+	block * spare;			// reset, reused before new ones are allocated
+	unsigned int spares;
+
+	static THREAD_LOCAL arena * current;
+
+	block * add_block(void);
+
+	arena(arena const&);			// Not implemented
+    void operator=(arena const&);	// Not implemented
+
+public:
+	arena(void);
+	~arena(void);
+
+	// terms of this thread allocate from a, NULL for the heap
+	static void attach(arena * a);
+	// nothing allocated from the arena may be used after reset
+	void reset(void);
+
+	static void * alloc(size_t);
+	static void free(void *);
+};
+
+// STL allocator on the arena of the calling thread
+template <class T> class arena_alloc
+{
+public:
+	typedef T			value_type;
+	typedef T *			pointer;
+	typedef const T *	const_pointer;
+	typedef T &			reference;
+	typedef const T &	const_reference;
+	typedef size_t		size_type;
+	typedef ptrdiff_t	difference_type;
+	template <class U> struct rebind { typedef arena_alloc<U> other; };
+
+	arena_alloc(void) {}
+	arena_alloc(const arena_alloc &) {}
+	template <class U> arena_alloc(const arena_alloc<U> &) {}
+
+	inline pointer address(reference x) const				{ return &x; }
+	inline const_pointer address(const_reference x) const	{ return &x; }
+	inline pointer allocate(size_type n, const void * = 0)	{ return (pointer)arena::alloc(n * sizeof(T)); }
+	inline void deallocate(pointer p, size_type)			{ arena::free(p); }
+	inline size_type max_size(void) const					{ return ((size_type)-1) / sizeof(T); }
+	inline void construct(pointer p, const T & v)			{ new((void *)p) T(v); }
+	inline void destroy(pointer p)							{ p->~T(); }
+};
+
+template <class T, class U> inline bool operator==(const arena_alloc<T> &, const arena_alloc<U> &) { return true; }
+template <class T, class U> inline bool operator!=(const arena_alloc<T> &, const arena_alloc<U> &) { return false; }
+
+#endif // ARENA_H
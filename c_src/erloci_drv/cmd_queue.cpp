@@ -14,34 +14,455 @@
  */ 
 
 #include "cmd_queue.h"
+#include "threads.h"
+#include "port.h"
+#include "encoder.h"
+#include "marshal.h"
+#include "ei.h"
+#include "evloop.h"
 
 cmd_queue cmd_queue::self;
 
 cmd_queue::cmd_queue(void)
+: closed(false)
 {
-	
+	memset(stats, 0, sizeof(stats));
+	ctl_weight = 4;
+	ctl_credit = ctl_weight;
+	idle = ctl_idle = 0;
+	queued = queued_bytes = peak_queued = 0;
+	max_cmds = QUEUE_MAX_CMDS;
+	max_bytes = QUEUE_MAX_BYTES;
+	rejected = 0;
+	expired = 0;
+	poll_ms = 0;
+	parked = 0;
 	if (INIT_LOCK(self.q_lock)) {
         return;
     }
+	if (INIT_COND(self.ctl_cond)) {
+        return;
+    }
+	if (INIT_COND(self.any_cond)) {
+        return;
+    }
 }
 
-vector<unsigned char> cmd_queue::pop()
+void cmd_queue::config(unsigned int ctl_weight, size_t max_cmds, size_t max_bytes)
 {
-	vector<unsigned char> p;
-	if(self.lock()) {
-		if (!self.cmdsq.empty()) {
-			p = self.cmdsq.front();
-			self.cmdsq.pop();
+	self.ctl_weight = (ctl_weight < 1 ? 1 : ctl_weight);
+	self.ctl_credit = self.ctl_weight;
+	self.max_cmds = max_cmds;
+	self.max_bytes = max_bytes;
+}
+
+unsigned long long cmd_queue::now_usec(void)
+{
+#ifdef __WIN32__
+	LARGE_INTEGER freq, cnt;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&cnt);
+	return (unsigned long long)((cnt.QuadPart / freq.QuadPart) * 1000000
+								+ (cnt.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+}
+
+// {deadline, Ms, Request} is cut down to Request, ms is -1 if pkt has no
+// deadline
+static long unwrap_deadline(vector<unsigned char> & pkt)
+{
+	if (pkt.empty())
+		return -1;
+
+	const char * b = (const char *)&pkt[0];
+	int idx = 0, ver = 0, arity = 0;
+	long ms = 0;
+	char atom[MAXATOMLEN];
+	if (ei_decode_version(b, &idx, &ver) < 0
+		|| ei_decode_tuple_header(b, &idx, &arity) < 0 || arity != 3
+		|| ei_decode_atom(b, &idx, atom) < 0 || strcmp(atom, "deadline") != 0
+		|| ei_decode_long(b, &idx, &ms) < 0 || ms < 0)
+		return -1;
+
+	// keeps the version byte
+	pkt.erase(pkt.begin() + 1, pkt.begin() + idx);
+	return ms;
+}
+
+// Command code and session handle of {From, Cmd, SessionHandle, ...} read
+// without decoding the whole request, sess is 0 for commands not bound to a
+// session, From is at pkt[from, from_end), from_end is 0 if it was not found
+static void peek(vector<unsigned char> & pkt, int & cmd, unsigned long long & sess, int & from, int & from_end)
+{
+	cmd = CMD_UNKWN;
+	sess = 0;
+	from = from_end = 0;
+	if (pkt.empty())
+		return;
+
+	const char * b = (const char *)&pkt[0];
+	int idx = 0, ver = 0, arity = 0;
+	long c = 0;
+	if (ei_decode_version(b, &idx, &ver) < 0
+		|| ei_decode_tuple_header(b, &idx, &arity) < 0 || arity < 2)
+		return;
+	from = idx;
+	if (ei_skip_term(b, &idx) < 0)
+		return;
+	from_end = idx;
+	if (ei_decode_long(b, &idx, &c) < 0)
+		return;
+	cmd = (int)c;
+
+	switch (cmd) {
+	case PUT_SESSN:
+	case PREP_STMT:
+	case BIND_ARGS:
+	case EXEC_STMT:
+	case FTCH_ROWS:
+	case CLSE_STMT:
+	case CMT_SESSN:
+	case RBK_SESSN:
+	case CMD_DSCRB:
+	case GET_LOBDA:
+	case SESN_PING:
+		break;
+	default:	// CMD_CANCEL too, it must reach a session busy in a call
+		return;
+	}
+	if (arity < 3)
+		return;
+
+	long long s = 0;
+	int sidx = idx;
+	if (ei_decode_longlong(b, &sidx, &s) == 0)
+		sess = (unsigned long long)s;
+	else if (ei_decode_ulonglong(b, &idx, &sess) != 0)
+		sess = 0;
+}
+
+static int lane_of(int cmd)
+{
+	switch (cmd) {
+	case RMOTE_MSG:
+	case PUT_SESSN:
+	case CLSE_STMT:
+	case CMT_SESSN:
+	case RBK_SESSN:
+	case CMD_ECHOT:
+	case SESN_PING:
+	case PORT_STAT:
+	case CMD_CANCEL:
+		return LANE_CTL;
+	default:
+		return LANE_WORK;
+	}
+}
+
+// {From, Cmd, {error, Reason}} with From copied from the request
+static void reply_error(vector<unsigned char> & pkt, int from, int from_end, int cmd, const char * reason)
+{
+	if (from_end <= from) {
+		REMOTE_LOG(ERR, "%s, dropped malformed request of %u bytes\n", reason, (unsigned int)pkt.size());
+		return;
+	}
+	encoder enc;
+	enc.version();
+	enc.tuple_header(3);
+	enc.raw(&pkt[from], from_end - from);
+	enc.integer(cmd);
+	enc.tuple_header(2);
+	enc.atom("error");
+	enc.atom(reason);
+	port::instance().write_cmd(enc.buffer());
+}
+
+void cmd_queue::make_ready(cmd_job & job)
+{
+	int lane = lane_of(job.cmd);
+	lanes[lane].push(cmd_job());
+	cmd_job & j = lanes[lane].back();
+	j.fn = job.fn;
+	j.arg = job.arg;
+	j.sess = job.sess;
+	j.cmd = job.cmd;
+	j.queued = now_usec();
+	j.deadline = job.deadline;
+	j.resumed = job.resumed;
+	j.pkt.swap(job.pkt);
+	if (lane == LANE_CTL)
+		SIGNAL_COND(ctl_cond);
+	SIGNAL_COND(any_cond);
+}
+
+// weighted round robin between the lanes, -1 if nothing is ready
+int cmd_queue::next_lane(bool control)
+{
+	bool ctl = !lanes[LANE_CTL].empty();
+	if (control)
+		return (ctl ? LANE_CTL : -1);
+	bool work = !lanes[LANE_WORK].empty();
+	if (ctl && (!work || ctl_credit > 0)) {
+		if (ctl_credit > 0)
+			--ctl_credit;
+		return LANE_CTL;
+	}
+	if (work) {
+		ctl_credit = ctl_weight;
+		return LANE_WORK;
+	}
+	return -1;
+}
+
+bool cmd_queue::pop(vector<unsigned char> & buf, unsigned long long & sess, unsigned long long & deadline,
+					bool control, unsigned int idle_ms)
+{
+	unsigned long long until = (idle_ms > 0 ? now_usec() + idle_ms * 1000ULL : 0);
+	for (;;) {
+		bool got = false, late = false;
+		job_fn fn = NULL;
+		void * arg = NULL;
+		buf.clear();
+		sess = 0;
+		deadline = 0;
+		if(!self.lock())
+			return false;
+		int lane;
+		while ((lane = self.next_lane(control)) < 0 && !self.closed) {
+			if (control) {
+				++self.ctl_idle;
+				WAIT_COND(self.ctl_cond, self.q_lock);
+				--self.ctl_idle;
+				continue;
+			}
+			unsigned long long now = (until != 0 ? now_usec() : 0);
+			if (until != 0 && now >= until)
+				break;
+			++self.idle;
+			if (until == 0) {
+				WAIT_COND(self.any_cond, self.q_lock);
+			} else {
+				TIMED_WAIT_COND(self.any_cond, self.q_lock, (unsigned int)((until - now + 999) / 1000));
+			}
+			--self.idle;
+		}
+		if (lane >= 0 && self.lanes[lane].front().fn != NULL) {
+			fn = self.lanes[lane].front().fn;
+			arg = self.lanes[lane].front().arg;
+			self.lanes[lane].pop();
+		} else if (lane >= 0) {
+			cmd_job & j = self.lanes[lane].front();
+			unsigned long long now = now_usec();
+			unsigned long long waited = now - j.queued;
+			lane_stat & st = self.stats[lane];
+			++st.cmds;
+			st.wait_us += waited;
+			if (waited > st.wait_max_us)
+				st.wait_max_us = waited;
+			--self.queued;
+			self.queued_bytes -= j.pkt.size();
+			buf.swap(j.pkt);
+			sess = j.sess;
+			deadline = j.deadline;
+			self.lanes[lane].pop();
+			// a resumed call is interrupted by its deadline timer instead
+			if (deadline != 0 && now >= deadline && !j.resumed) {
+				++self.expired;
+				late = true;
+			} else
+				got = true;
 		}
  		self.unlock();
-    }
-	return p;
+		if (fn != NULL) {
+			(*fn)(arg);
+			continue;
+		}
+		if (!late)
+			return got;
+
+		// the caller gave up already, the next command of the session may run
+		int cmd, from, from_end;
+		unsigned long long s;
+		peek(buf, cmd, s, from, from_end);
+		reply_error(buf, from, from_end, cmd, "timeout");
+		done(sess);
+	}
+}
+
+bool cmd_queue::starved(void)
+{
+	bool ret = false;
+	if(self.lock()) {
+		// an idle control worker takes the control commands
+		ret = (self.idle == 0 && (!self.lanes[LANE_WORK].empty()
+								  || (!self.lanes[LANE_CTL].empty() && self.ctl_idle == 0)));
+		self.unlock();
+	}
+	return ret;
 }
 
 void cmd_queue::push(vector<unsigned char> & buf)
+{
+	cmd_job job;
+	int from, from_end;
+	job.fn = NULL;
+	job.arg = NULL;
+	long ms = unwrap_deadline(buf);
+	job.deadline = (ms < 0 ? 0 : now_usec() + ms * 1000ULL);
+	job.resumed = false;
+	peek(buf, job.cmd, job.sess, from, from_end);
+	job.pkt.swap(buf);
+	if(self.lock()) {
+		// control commands are small and keep the port manageable
+		if (lane_of(job.cmd) == LANE_WORK
+			&& (self.queued >= self.max_cmds || self.queued_bytes + job.pkt.size() > self.max_bytes)) {
+			++self.rejected;
+			self.unlock();
+			reply_error(job.pkt, from, from_end, job.cmd, "overloaded");
+			return;
+		}
+		++self.queued;
+		self.queued_bytes += job.pkt.size();
+		if (self.queued > self.peak_queued)
+			self.peak_queued = self.queued;
+
+		if (job.sess != 0) {
+			map<unsigned long long, mailbox>::iterator it = self.mboxes.find(job.sess);
+			if (it != self.mboxes.end()) {
+				// the session is busy, wait for its previous command
+				it->second.cmds.push(cmd_job());
+				cmd_job & j = it->second.cmds.back();
+				j.fn = NULL;
+				j.arg = NULL;
+				j.sess = job.sess;
+				j.cmd = job.cmd;
+				j.deadline = job.deadline;
+				j.resumed = false;
+				j.pkt.swap(job.pkt);
+				self.unlock();
+				return;
+			}
+			self.mboxes[job.sess];
+		}
+		self.make_ready(job);
+		self.unlock();
+		threads::grow();
+	}
+}
+
+void cmd_queue::done(unsigned long long sess)
+{
+	if (sess == 0)
+		return;
+	if(self.lock()) {
+		map<unsigned long long, mailbox>::iterator it = self.mboxes.find(sess);
+		if (it != self.mboxes.end()) {
+			if (it->second.cmds.empty()) {
+				self.mboxes.erase(it);
+			} else {
+				self.make_ready(it->second.cmds.front());
+				it->second.cmds.pop();
+			}
+		}
+		self.unlock();
+	}
+}
+
+void cmd_queue::park_config(unsigned int poll_ms)
+{
+	self.poll_ms = poll_ms;
+
+	REMOTE_LOG(INF, "non-blocking calls polled every %u ms", poll_ms);
+}
+
+void cmd_queue::park(vector<unsigned char> & buf, unsigned long long sess, unsigned long long deadline)
+{
+	cmd_job * j = new cmd_job;
+	int from, from_end;
+	unsigned long long s;
+	j->fn = NULL;
+	j->arg = NULL;
+	peek(buf, j->cmd, s, from, from_end);
+	j->sess = sess;
+	j->deadline = deadline;
+	j->resumed = true;
+	j->pkt.swap(buf);
+	if(self.lock()) {
+		++self.parked;
+		self.unlock();
+	}
+#ifdef __WIN32__
+	// no event loop to wait on, non-blocking execution is not enabled
+	resume(j);
+#else
+	evloop::timer(self.poll_ms, resume, j);
+#endif
+}
+
+// on the event loop, the parked call is queued ahead of the queue bounds
+void cmd_queue::resume(void * arg)
+{
+	cmd_job * j = (cmd_job *)arg;
+	if(self.lock()) {
+		--self.parked;
+		++self.queued;
+		self.queued_bytes += j->pkt.size();
+		self.make_ready(*j);
+		self.unlock();
+	}
+	delete j;
+	threads::grow();
+}
+
+void cmd_queue::post(job_fn fn, void * arg)
+{
+	cmd_job job;
+	job.fn = fn;
+	job.arg = arg;
+	job.sess = 0;
+	job.cmd = CMD_CANCEL;	// LANE_CTL
+	job.deadline = 0;
+	job.resumed = false;
+	if(self.lock()) {
+		self.make_ready(job);
+		self.unlock();
+	}
+	threads::grow();
+}
+
+void cmd_queue::close()
+{
+	if(self.lock()) {
+		self.closed = true;
+		BROADCAST_COND(self.ctl_cond);
+		BROADCAST_COND(self.any_cond);
+		self.unlock();
+	}
+}
+
+void cmd_queue::lane_stats(int lane, lane_stat & st)
+{
+	memset(&st, 0, sizeof(st));
+	if(lane >= 0 && lane < LANE_COUNT && self.lock()) {
+		st = self.stats[lane];
+		self.unlock();
+	}
+}
+
+void cmd_queue::depth(size_t & cmds, size_t & bytes, size_t & peak, unsigned long long & rejected,
+					  unsigned long long & expired, size_t & parked)
 {
 	if(self.lock()) {
-		self.cmdsq.push(buf);
+		parked = self.parked;
+		cmds = self.queued;
+		bytes = self.queued_bytes;
+		peak = self.peak_queued;
+		rejected = self.rejected;
+		expired = self.expired;
 		self.unlock();
 	}
 }
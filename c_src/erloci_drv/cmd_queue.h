@@ -19,15 +19,74 @@
 
 #include <vector>
 #include <queue>
+#include <map>
 
 using namespace std;
 
+// Lanes of ready commands, cheap control commands are served by reserved
+// workers and ahead of heavy work by the others
+typedef enum _CMD_LANE {
+	LANE_CTL	= 0,	// ping, commit, rollback, close, cancel, log switch, stats
+	LANE_WORK	= 1,	// session open, prepare, bind, execute, fetch, describe, lob
+	LANE_COUNT	= 2
+} CMD_LANE;
+
+typedef void (*job_fn)(void *);
+
+// command ready for a worker, sess is 0 if it is not bound to a session,
+// fn is set for work of the port itself, run instead of a command
+typedef struct cmd_job {
+	job_fn fn;
+	void * arg;
+	unsigned long long sess;
+	int cmd;
+	unsigned long long queued;	// usec, when it became ready
+	unsigned long long deadline;	// usec, 0 if the request has none
+	bool resumed;				// parked non-blocking call issued again
+	vector<unsigned char> pkt;
+} cmd_job;
+
+// commands of one session waiting behind the one ready or running
+typedef struct mailbox {
+	queue<cmd_job> cmds;
+} mailbox;
+
+#define QUEUE_MAX_CMDS	1024
+#define QUEUE_MAX_BYTES	0x04000000UL	// 64MB
+
+typedef struct lane_stat {
+	unsigned long long cmds;
+	unsigned long long wait_us;		// total time ready commands waited for a worker
+	unsigned long long wait_max_us;
+} lane_stat;
+
+// Commands of one session run strictly in order, one at a time, on any
+// worker, different sessions and session-less commands run in parallel
 class cmd_queue
 {
 private:
 	static cmd_queue self;
 	mutex_type q_lock;
-	queue<vector<unsigned char> > cmdsq;
+	cond_type ctl_cond;		// control workers
+	cond_type any_cond;		// general workers
+	bool closed;
+	queue<cmd_job> lanes[LANE_COUNT];
+	lane_stat stats[LANE_COUNT];
+	unsigned int ctl_weight;	// control commands taken per heavy one when both wait
+	unsigned int ctl_credit;
+	unsigned int idle;			// general workers waiting in pop
+	unsigned int ctl_idle;		// control workers waiting in pop
+	map<unsigned long long, mailbox> mboxes;	// sessions with a command ready or running
+	size_t queued;				// commands and bytes waiting, ready or in a mailbox
+	size_t queued_bytes;
+	size_t peak_queued;
+	size_t max_cmds;			// heavy commands beyond these are rejected
+	size_t max_bytes;
+	unsigned long long rejected;
+	unsigned long long expired;	// dropped, deadline passed before a worker took them
+	unsigned int poll_ms;
+	size_t parked;				// non-blocking calls waiting to be issued again
+	static void resume(void *);
 
 	cmd_queue(void);
 	cmd_queue(cmd_queue const&);        // Not implemented
@@ -35,11 +94,38 @@ private:
 
 	inline bool lock()		{ return LOCK(q_lock);	}
 	inline void unlock()	{ UNLOCK(q_lock);		}
+	void make_ready(cmd_job &);
+	int next_lane(bool);
 
 public:
-	static vector<unsigned char> pop(void);
-	static void push(vector<unsigned char> &);
-	static inline size_t size() { return self.cmdsq.size(); };
+	static void config(unsigned int ctl_weight, size_t max_cmds, size_t max_bytes);
+	// monotonic usec of the queue times and deadlines
+	static unsigned long long now_usec(void);
+	// blocks until a command is ready, false once the queue is closed or
+	// nothing arrived for idle_ms (0 waits forever), control workers only
+	// take LANE_CTL commands, commands past their deadline are answered
+	// with {error, timeout} instead
+	static bool pop(vector<unsigned char> & buf, unsigned long long & sess, unsigned long long & deadline,
+					bool control, unsigned int idle_ms = 0);
+	// commands are ready but no worker that may take them is waiting
+	static bool starved(void);
+	// buf is swapped into the queue, no copy is made, a LANE_WORK command
+	// arriving while the queue is full is answered with {error, overloaded},
+	// {deadline, Ms, Request} is unwrapped, Ms counting from now
+	static void push(vector<unsigned char> & buf);
+	// a worker finished the command popped for sess
+	static void done(unsigned long long sess);
+	// non-blocking OCI calls still executing are issued again every poll_ms,
+	// 0 disables non-blocking execution
+	static void park_config(unsigned int poll_ms);
+	// buf is swapped out and made ready again after poll_ms
+	static void park(vector<unsigned char> & buf, unsigned long long sess, unsigned long long deadline);
+	// fn(arg) runs on a worker taking LANE_CTL commands, outside the queue bounds
+	static void post(job_fn fn, void * arg);
+	static void close(void);
+	static void lane_stats(int lane, lane_stat & st);
+	static void depth(size_t & cmds, size_t & bytes, size_t & peak, unsigned long long & rejected,
+					  unsigned long long & expired, size_t & parked);
 };
 
 #endif // CMD_QUEUE_H
@@ -16,6 +16,10 @@
 #include <stdlib.h>
 
 #include "command.h"
+#include "encoder.h"
+#include "cmd_queue.h"
+#include "threads.h"
+#include "evloop.h"
 #include "ocisession.h"
 
 #include "transcoder.h"
@@ -33,6 +37,82 @@ void command::config(intf_funs ifn)
 	ocistmt::config(ifn);
 }
 
+static bool deadline_passed(unsigned long long deadline)
+{
+	return (deadline != 0 && cmd_queue::now_usec() >= deadline);
+}
+
+#ifndef __WIN32__
+// call of a session to break once its deadline passed
+typedef struct deadline_req {
+	ocisession * sess;
+	unsigned long long seq;
+} deadline_req;
+
+// on a control worker, a no-op if the call ended or the session was released
+static void break_call(void * arg)
+{
+	deadline_req * d = (deadline_req *)arg;
+	try {
+		if (ocisession::cancel(d->sess, NULL, d->seq))
+			REMOTE_LOG(INF, "deadline passed, call %llu of session %p interrupted\n", d->seq, d->sess);
+	} catch (...) {
+		REMOTE_LOG(ERR, "deadline passed, failed to interrupt session %p\n", d->sess);
+	}
+	delete d;
+}
+
+// on the event loop, which must not block in OCIBreak
+static void on_deadline(void * arg)
+{
+	deadline_req * d = (deadline_req *)arg;
+	deadline_req * b = new deadline_req;
+	*b = *d;
+	cmd_queue::post(break_call, b);
+}
+
+static void release_deadline(void * arg)
+{
+	delete (deadline_req *)arg;
+}
+#endif
+
+// Times the OCI call of its scope, the timer is removed once the scope ends.
+// Windows has no event loop to time the calls, expired commands are only
+// dropped before they run
+class call_deadline
+{
+#ifndef __WIN32__
+	evtimer_req * tmr_;
+#endif
+
+	call_deadline(call_deadline const&);	// Not implemented
+    void operator=(call_deadline const&);	// Not implemented
+
+public:
+	call_deadline(ocisession * sess, unsigned long long seq, unsigned long long deadline)
+	{
+#ifndef __WIN32__
+		tmr_ = NULL;
+		if (deadline == 0)
+			return;
+		unsigned long long now = cmd_queue::now_usec();
+		deadline_req * d = new deadline_req;
+		d->sess = sess;
+		d->seq = seq;
+		tmr_ = evloop::timeout(deadline > now ? (unsigned int)((deadline - now + 999) / 1000) : 0,
+							   on_deadline, release_deadline, d);
+#endif
+	}
+	~call_deadline()
+	{
+#ifndef __WIN32__
+		if (tmr_ != NULL)
+			evloop::cancel(tmr_);
+#endif
+	}
+};
+
 bool command::change_log_flag(term & t, term & resp)
 {
     bool ret = false;
@@ -84,9 +164,9 @@ bool command::get_session(term & t, term & resp)
     if(con_str.is_binary() && usr_str.is_binary() && passwrd.is_binary()) {
 		try {
 			ocisession * conn_handle = new ocisession(
-				&con_str.str[0], con_str.str_len,		// Connect String
-				&usr_str.str[0], usr_str.str_len,		// User Name String
-				&passwrd.str[0], passwrd.str_len);		// Password String
+				con_str.str(), con_str.str_len,		// Connect String
+				usr_str.str(), usr_str.str_len,		// User Name String
+				passwrd.str(), passwrd.str_len);		// Password String
 			REMOTE_LOG(INF, "got connection %lu\n", (unsigned long long)conn_handle);
 			resp.insert().integer((unsigned long long)conn_handle);
 		} catch (intf_ret r) {
@@ -123,6 +203,53 @@ bool command::get_session(term & t, term & resp)
 	return ret;
 }
 
+bool command::warm_pool(term & t, term & resp)
+{
+    bool ret = false;
+
+	// {{pid, ref}, WARM_POOL, Connection String, User name, Password}
+	term & con_str = t[2];
+	term & usr_str = t[3];
+	term & passwrd = t[4];
+    if(con_str.is_binary() && usr_str.is_binary() && passwrd.is_binary()) {
+		try {
+			ocisession::warm_pool(
+				con_str.str(), con_str.str_len,		// Connect String
+				usr_str.str(), usr_str.str_len,		// User Name String
+				passwrd.str(), passwrd.str_len);		// Password String
+			resp.insert().atom("ok");
+		} catch (intf_ret r) {
+			term & _t = resp.insert().tuple();
+			_t.insert().atom("error");
+			term & _t1 = _t.insert().tuple();
+			_t1.insert().integer(r.gerrcode);
+			_t1.insert().binary(r.gerrbuf);
+			if(resp.is_undef()) REMOTE_LOG(ERR, "ERROR %s\n", r.gerrbuf);
+		} catch (string str) {
+			term & _t = resp.insert().tuple();
+			_t.insert().atom("error");
+			term & _t1 = _t.insert().tuple();
+			_t1.insert().integer(0);
+			_t1.insert().binary(str.c_str());
+			if(resp.is_undef()) REMOTE_LOG(ERR, "ERROR %s\n", str.c_str());
+		} catch (...) {
+			term & _t = resp.insert().tuple();
+			_t.insert().atom("error");
+			term & _t1 = _t.insert().tuple();
+			_t1.insert().integer(0);
+			_t1.insert().atom("unknwon");
+			if(resp.is_undef()) REMOTE_LOG(ERR, "ERROR unknown\n");
+		}
+	}
+
+	if(resp.is_undef()) REMOTE_LOG(CRT, "driver error: no resp generated, shutting down port\n");
+    vector<unsigned char> respv = tc.encode(resp);
+    if(p.write_cmd(respv) <= 0)
+        ret = true;
+
+	return ret;
+}
+
 bool command::release_conn(term & t, term & resp)
 {
     bool ret = false;
@@ -328,10 +455,10 @@ bool command::describe(term & t, term & resp)
 		unsigned char desc_typ = (unsigned char)(objct_type.v.ll);
 
 		try {
-	        conn_handle->describe_object(&obj_string.str[0], obj_string.str_len, desc_typ, &describes);
+	        conn_handle->describe_object((void *)obj_string.str(), obj_string.str_len, desc_typ, &describes);
 			term & _t = resp.insert().tuple();
 			_t.insert().atom("desc");
-			_t.add(describes);
+			_t.take(describes);
 		} catch (intf_ret r) {
 			term & _t = resp.insert().tuple();
 			_t.insert().atom("error");
@@ -341,7 +468,7 @@ bool command::describe(term & t, term & resp)
 			if (r.fn_ret == CONTINUE_WITH_ERROR) {
 				if(resp.is_undef())
 					REMOTE_LOG(INF, "Continue with ERROR Execute DESCRIBE \"%.*s;\" -> %s\n",
-						t[3].str_len, &t[3].str[0], r.gerrbuf);
+						t[3].str_len, t[3].str(), r.gerrbuf);
 			} else {
 				if(resp.is_undef()) REMOTE_LOG(ERR, "ERROR %s\n", r.gerrbuf);
 				ret = true;
@@ -388,7 +515,7 @@ bool command::prep_sql(term & t, term & resp)
 
 		ocisession * conn_handle = (ocisession *)(connection.v.ll);
 		try {
-	        ocistmt * statement_handle = conn_handle->prepare_stmt((unsigned char *)&sql_string.str[0], sql_string.str_len);
+	        ocistmt * statement_handle = conn_handle->prepare_stmt((unsigned char *)sql_string.str(), sql_string.str_len);
 			term & _t = resp.insert().tuple();
 			_t.insert().atom("stmt");
 			_t.insert().integer((unsigned long long)statement_handle);
@@ -401,7 +528,7 @@ bool command::prep_sql(term & t, term & resp)
 			if (r.fn_ret == CONTINUE_WITH_ERROR) {
 				if(resp.is_undef())
 					REMOTE_LOG(INF, "Continue with ERROR Execute SQL \"%.*s;\" -> %s\n",
-						t[3].str_len, &t[3].str[0], r.gerrbuf);
+						t[3].str_len, t[3].str(), r.gerrbuf);
 			} else {
 				if(resp.is_undef()) REMOTE_LOG(ERR, "ERROR %s\n", r.gerrbuf);
 				ret = true;
@@ -495,7 +622,7 @@ bool command::bind_args(term & t, term & resp)
     return ret;
 }
 
-bool command::exec_stmt(term & t, term & resp)
+bool command::exec_stmt(term & t, term & resp, unsigned long long deadline, bool & parked)
 {
 	bool ret = false;
 
@@ -504,10 +631,11 @@ bool command::exec_stmt(term & t, term & resp)
 	term & statement = t[3];
 	term & bind_list = t[4];
 	term & auto_cmit = t[5];
-    term columns, rowids, outdata;
+    term columns, rowids, outdata, errors;
 	columns.lst();
 	rowids.lst();
 	outdata.lst();
+	errors.lst();
     if(conection.is_any_int() && statement.is_any_int() && bind_list.is_list() && auto_cmit.is_any_int()) {
 		ocisession * conn_handle = (ocisession *)(conection.v.ll);
 		ocistmt * statement_handle = (ocistmt *)(statement.v.ll);
@@ -520,40 +648,59 @@ bool command::exec_stmt(term & t, term & resp)
 				_t.insert().binary("invalid statement handle");
 				if(resp.is_undef()) REMOTE_LOG(ERR, "ERROR invalid statement handle\n");
 			} else {
-				size_t bound_count = map_value_to_bind_args(bind_list, statement_handle->get_in_bind_args());
-				unsigned int exec_ret = statement_handle->execute(&columns, &rowids, &outdata, auto_commit);
+				// a resumed execute is bound already
+				bool resumed = statement_handle->pending();
+				ocicall call(conn_handle, statement_handle);
+				call_deadline timed(conn_handle, call.seq(), deadline);
+				size_t bound_count = 0;
+				if (!resumed)
+					bound_count = map_value_to_bind_args(bind_list, statement_handle->get_in_bind_args());
+				unsigned int exec_ret = statement_handle->execute(&columns, &rowids, &outdata, &errors, auto_commit);
 				if (bound_count) REMOTE_LOG(DBG, "Bounds %u", bound_count);
 				// TODO : Also return bound values from here
 				term & _t = resp.insert().tuple();
-				if (columns.length() == 0 && rowids.length() == 0) {
+				if (errors.length() > 0) {
+					// {error, [{Row, Code, Msg}, ...]} for rows failed in a batch
+					_t.insert().atom("error");
+					_t.take(errors);
+				} else if (columns.length() == 0 && rowids.length() == 0) {
 					_t.insert().atom("executed");
 					_t.insert().integer(exec_ret);
 					if (outdata.length() > 0)
-						_t.add(outdata);
+						_t.take(outdata);
 				} else if (columns.length() > 0 && rowids.length() == 0) {
 					_t.insert().atom("cols");
-					_t.add(columns);
+					_t.take(columns);
 				} else if (columns.length() == 0 && rowids.length() > 0) {
 					_t.insert().atom("rowids");
-					_t.add(rowids);
+					_t.take(rowids);
 				} else {
 					_t.insert().atom("cols");
-					_t.add(columns);
-					_t = resp.insert().tuple();
-					_t.insert().atom("rowids");
-					_t.add(rowids);
+					_t.take(columns);
+					term & _t2 = resp.insert().tuple();
+					_t2.insert().atom("rowids");
+					_t2.take(rowids);
 				}
 			}
 		} catch (intf_ret r) {
+			if (r.fn_ret == PENDING) {
+				parked = true;
+				return ret;
+			}
 			term & _t = resp.insert().tuple();
 			_t.insert().atom("error");
-			term & _t1 = _t.insert().tuple();
-			_t1.insert().integer(r.gerrcode);
-			_t1.insert().binary(r.gerrbuf);
+			if (r.gerrcode == ORA_CANCELLED) {
+				// interrupted by CMD_CANCEL or the deadline
+				_t.insert().atom(deadline_passed(deadline) ? "timeout" : "cancelled");
+			} else {
+				term & _t1 = _t.insert().tuple();
+				_t1.insert().integer(r.gerrcode);
+				_t1.insert().binary(r.gerrbuf);
+			}
 			if (r.fn_ret == CONTINUE_WITH_ERROR) {
 				if(resp.is_undef())
 					REMOTE_LOG(INF, "Continue with ERROR Execute SQL \"%.*s;\" -> %s\n",
-						t[3].str_len, &t[3].str[0], r.gerrbuf);
+						t[3].str_len, t[3].str(), r.gerrbuf);
 			} else {
 				if(resp.is_undef()) REMOTE_LOG(ERR, "ERROR %s\n", r.gerrbuf);
 				ret = true;
@@ -587,7 +734,7 @@ bool command::exec_stmt(term & t, term & resp)
 	return ret;
 }
 
-bool command::fetch_rows(term & t, term & resp)
+bool command::fetch_rows(term & t, term & resp, unsigned long long deadline, bool & parked)
 {
 	bool ret = false;
 
@@ -595,8 +742,18 @@ bool command::fetch_rows(term & t, term & resp)
 	term & conection = t[2];
 	term & statement = t[3];
 	term & row_count = t[4];
-	term rows;
-	rows.lst();
+
+	// {Ref, FTCH_ROWS, {{rows, [...]}, Done, {fetched, Rows, Bytes}}} is written row by row
+	encoder enc(max_term_byte_size);
+	enc.version();
+	enc.tuple_header(3);
+	enc.add(resp[0]);
+	enc.add(resp[1]);
+	enc.tuple_header(3);
+	enc.tuple_header(2);
+	enc.atom("rows");
+	enc.open_rows();
+	bool streamed = false;
     if(conection.is_any_int() && statement.is_any_int() && row_count.is_any_int()) {
 
 		ocisession * conn_handle = (ocisession *)(conection.v.ll);
@@ -610,21 +767,34 @@ bool command::fetch_rows(term & t, term & resp)
 				_t.insert().binary("invalid statement handle");
 				if(resp.is_undef()) REMOTE_LOG(ERR, "ERROR invalid statement handle\n");
 			} else {
-				intf_ret r = statement_handle->rows(&rows, rowcount);
+				ocicall call(conn_handle, statement_handle);
+				call_deadline timed(conn_handle, call.seq(), deadline);
+				intf_ret r = statement_handle->rows(&enc, rowcount, marshall_stream_funs);
+				if (r.fn_ret == PENDING) {
+					parked = true;
+					return ret;
+				}
 				if (r.fn_ret == MORE || r.fn_ret == DONE) {
-					term & _t = resp.insert().tuple();
-					term & _t1 = _t.insert().tuple();
-					_t1.insert().atom("rows");
-					_t1.add(rows);
-					_t.insert().atom((r.fn_ret == MORE && rows.length() > 0) ? "false" : "true");
+					unsigned int nrows = enc.close_rows();
+					enc.atom((r.fn_ret == MORE && nrows > 0) ? "false" : "true");
+					enc.tuple_header(3);
+					enc.atom("fetched");
+					enc.uinteger(nrows);
+					enc.uinteger(statement_handle->fetched_bytes());
+					streamed = true;
 				}
 			}
 		} catch (intf_ret r) {
 			term & _t = resp.insert().tuple();
 			_t.insert().atom("error");
-			term & _t1 = _t.insert().tuple();
-			_t1.insert().integer(r.gerrcode);
-			_t1.insert().binary(r.gerrbuf);
+			if (r.gerrcode == ORA_CANCELLED) {
+				// interrupted by CMD_CANCEL or the deadline
+				_t.insert().atom(deadline_passed(deadline) ? "timeout" : "cancelled");
+			} else {
+				term & _t1 = _t.insert().tuple();
+				_t1.insert().integer(r.gerrcode);
+				_t1.insert().binary(r.gerrbuf);
+			}
 			if (r.fn_ret == CONTINUE_WITH_ERROR) {
 				if(resp.is_undef())
 					REMOTE_LOG(INF, "Continue with ERROR fetch STMT %s\n", r.gerrbuf);
@@ -653,6 +823,12 @@ bool command::fetch_rows(term & t, term & resp)
 //		REMOTE_LOG_TERM(ERR, command, "argument type(s) missmatch\n");
 	}
 
+	if (streamed) {
+		if(p.write_cmd(enc.buffer()) <= 0)
+			ret = true;
+		return ret;
+	}
+
 	if(resp.is_undef()) REMOTE_LOG(CRT, "driver error: no resp generated, shutting down port\n");
     vector<unsigned char> respv = tc.encode(resp);
     if(p.write_cmd(respv) <= 0)
@@ -747,7 +923,7 @@ bool command::get_lob_data(term & t, term & resp)
 				if(r.fn_ret == SUCCESS) {
 					term & _t = resp.insert().tuple();
 					_t.insert().atom("lob");
-					_t.add(lob);
+					_t.take(lob);
 				}
 			}
 		} catch (intf_ret r) {
@@ -798,7 +974,7 @@ bool command::echo(term & t, term & resp)
 
 	// {{pid, ref}, CMD_ECHOT, Term}
 	try {
-		resp.add(t[2]);
+		resp.take(t[2]);
 	} catch (intf_ret r) {
 		term & _t = resp.insert().tuple();
 		_t.insert().atom("error");
@@ -833,9 +1009,136 @@ bool command::echo(term & t, term & resp)
     return ret;
 }
 
+bool command::cancel(term & t, term & resp)
+{
+	bool ret = false;
+
+	// {{pid, ref}, CMD_CANCEL, Connection Handle, Statement Handle | 0}
+	// not serialized behind the session, the session is busy in the call to cancel
+	term & conection = t[2];
+	term & statement = t[3];
+	if(conection.is_any_int() && statement.is_any_int()) {
+		ocisession * conn_handle = (ocisession *)(conection.v.ll);
+		ocistmt * statement_handle = (ocistmt *)(statement.v.ll);
+		try {
+			if (ocisession::cancel(conn_handle, statement_handle))
+				resp.insert().atom("ok");
+			else {
+				term & _t = resp.insert().tuple();
+				_t.insert().atom("error");
+				_t.insert().atom("not_running");
+			}
+		} catch (intf_ret r) {
+			term & _t = resp.insert().tuple();
+			_t.insert().atom("error");
+			term & _t1 = _t.insert().tuple();
+			_t1.insert().integer(r.gerrcode);
+			_t1.insert().binary(r.gerrbuf);
+			if(resp.is_undef()) REMOTE_LOG(ERR, "ERROR %s\n", r.gerrbuf);
+		} catch (string str) {
+			term & _t = resp.insert().tuple();
+			_t.insert().atom("error");
+			term & _t1 = _t.insert().tuple();
+			_t1.insert().integer(0);
+			_t1.insert().binary(str.c_str());
+			if(resp.is_undef()) REMOTE_LOG(ERR, "ERROR %s\n", str.c_str());
+		} catch (...) {
+			term & _t = resp.insert().tuple();
+			_t.insert().atom("error");
+			term & _t1 = _t.insert().tuple();
+			_t1.insert().integer(0);
+			_t1.insert().atom("unknwon");
+			if(resp.is_undef()) REMOTE_LOG(ERR, "ERROR unknown\n");
+		}
+	} else {
+//		REMOTE_LOG_TERM(ERR, command, "argument type(s) missmatch\n");
+	}
+
+	if(resp.is_undef()) REMOTE_LOG(CRT, "driver error: no resp generated, shutting down port\n");
+    vector<unsigned char> respv = tc.encode(resp);
+    if(p.write_cmd(respv) <= 0)
+        ret = true;
+
+	return ret;
+}
+
 //#define PRINTCMD
 
-bool command::process(term & t)
+bool command::port_stat(term & t, term & resp)
+{
+	bool ret = false;
+
+	// {{pid, ref}, PORT_STAT}
+	unsigned long long hits = 0, misses = 0;
+	ocisession::stmt_cache_stats(hits, misses);
+
+	term & _l = resp.insert().lst();
+	term & _h = _l.insert().tuple();
+	_h.insert().atom("stmt_cache_hits");
+	_h.insert().integer(hits);
+	term & _m = _l.insert().tuple();
+	_m.insert().atom("stmt_cache_misses");
+	_m.insert().integer(misses);
+
+	unsigned int live = 0, peak = 0;
+	unsigned long long failed = 0;
+	threads::stats(live, peak, failed);
+	term & _w = _l.insert().tuple();
+	_w.insert().atom("workers");
+	_w.insert().integer(live);
+	term & _p = _l.insert().tuple();
+	_p.insert().atom("workers_peak");
+	_p.insert().integer(peak);
+	term & _f = _l.insert().tuple();
+	_f.insert().atom("worker_start_failures");
+	_f.insert().integer(failed);
+
+	size_t depth = 0, depth_bytes = 0, depth_peak = 0, parked = 0;
+	unsigned long long rejected = 0, expired = 0;
+	cmd_queue::depth(depth, depth_bytes, depth_peak, rejected, expired, parked);
+	term & _d = _l.insert().tuple();
+	_d.insert().atom("queue_depth");
+	_d.insert().integer((unsigned long long)depth);
+	term & _db = _l.insert().tuple();
+	_db.insert().atom("queue_bytes");
+	_db.insert().integer((unsigned long long)depth_bytes);
+	term & _dp = _l.insert().tuple();
+	_dp.insert().atom("queue_peak");
+	_dp.insert().integer((unsigned long long)depth_peak);
+	term & _r = _l.insert().tuple();
+	_r.insert().atom("overloaded");
+	_r.insert().integer(rejected);
+	term & _e = _l.insert().tuple();
+	_e.insert().atom("expired");
+	_e.insert().integer(expired);
+	term & _pk = _l.insert().tuple();
+	_pk.insert().atom("parked");
+	_pk.insert().integer((unsigned long long)parked);
+
+	// commands served per lane and how long they waited for a worker
+	const char * lane_keys[LANE_COUNT][3] = {
+		{"ctl_lane_cmds", "ctl_lane_wait_us", "ctl_lane_wait_max_us"},
+		{"work_lane_cmds", "work_lane_wait_us", "work_lane_wait_max_us"}};
+	for (int lane = 0; lane < LANE_COUNT; ++lane) {
+		lane_stat st;
+		cmd_queue::lane_stats(lane, st);
+		unsigned long long vals[3] = {st.cmds, st.wait_us, st.wait_max_us};
+		for (int i = 0; i < 3; ++i) {
+			term & _s = _l.insert().tuple();
+			_s.insert().atom(lane_keys[lane][i]);
+			_s.insert().integer(vals[i]);
+		}
+	}
+
+	if(resp.is_undef()) REMOTE_LOG(CRT, "driver error: no resp generated, shutting down port\n");
+    vector<unsigned char> respv = tc.encode(resp);
+    if(p.write_cmd(respv) <= 0)
+        ret = true;
+
+	return ret;
+}
+
+bool command::process(term & t, unsigned long long deadline, bool & parked)
 {
 	bool ret = false;
 	term resp;
@@ -850,7 +1153,7 @@ bool command::process(term & t)
 	if(t.is_tuple() && t[1].is_integer()) {
         int cmd = t[1].v.i;
 		resp.tuple();
-		resp.add(t[0]);
+		resp.take(t[0]);
 		resp.insert().integer(cmd);
         if((t.length() - 1) != (size_t)CMD_ARGS_COUNT(cmd)) {
 			term & _t = resp.insert().tuple();
@@ -872,12 +1175,15 @@ bool command::process(term & t)
             case CMD_DSCRB:	ret = describe(t, resp);		break;
             case PREP_STMT:	ret = prep_sql(t, resp);		break;
             case BIND_ARGS:	ret = bind_args(t, resp);		break;
-            case EXEC_STMT:	ret = exec_stmt(t, resp);		break;
-            case FTCH_ROWS:	ret = fetch_rows(t, resp);		break;
+            case EXEC_STMT:	ret = exec_stmt(t, resp, deadline, parked);	break;
+            case FTCH_ROWS:	ret = fetch_rows(t, resp, deadline, parked);	break;
             case CLSE_STMT:	ret = close_stmt(t, resp);		break;
             case GET_LOBDA:	ret = get_lob_data(t, resp);	break;
             case CMD_ECHOT:	ret = echo(t, resp);			break;
 		    case SESN_PING:	ret = ping(t, resp);			break;
+		    case PORT_STAT:	ret = port_stat(t, resp);		break;
+		    case CMD_CANCEL:	ret = cancel(t, resp);		break;
+		    case WARM_POOL:	ret = warm_pool(t, resp);		break;
             default:
 		    	ret = true;
                 break;
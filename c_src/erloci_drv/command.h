@@ -33,21 +33,26 @@ private:
 
 	static bool change_log_flag(term &, term &);
 	static bool get_session(term &, term &);
+	static bool warm_pool(term &, term &);
 	static bool release_conn(term &, term &);
 	static bool ping(term &, term &);
 	static bool commit(term &, term &);
 	static bool rollback(term &, term &);
 	static bool describe(term &, term &);
 	static bool prep_sql(term &, term &);
-	static bool fetch_rows(term &, term &);
-	static bool exec_stmt(term &, term &);
+	static bool fetch_rows(term &, term &, unsigned long long, bool &);
+	static bool exec_stmt(term &, term &, unsigned long long, bool &);
 	static bool close_stmt(term &, term &);
 	static bool bind_args(term &, term &);
 	static bool get_lob_data(term &, term &);
 	static bool echo(term &, term &);
+	static bool port_stat(term &, term &);
+	static bool cancel(term &, term &);
 
 public:
-	static bool process(term &);
+	// deadline in cmd_queue::now_usec() time, 0 for none, parked if the
+	// command is still executing non-blocking and must be processed again
+	static bool process(term &, unsigned long long deadline, bool & parked);
 	static void config(intf_funs);
 };
 
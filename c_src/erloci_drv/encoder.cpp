@@ -0,0 +1,173 @@
+/* Copyright 2014 K2Informatics GmbH, Root Laengenbold, Switzerland
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */ 
+#include "encoder.h"
+#include "transcoder.h"
+
+#include "ei.h"
+
+#include <string.h>
+
+encoder::encoder(size_t reserve)
+: rows_pos(0), row_count(0), row_pos(0), row_start(0), cell_count(0)
+{
+	buf.reserve(reserve);
+}
+
+void encoder::put32(ul4 v)
+{
+	buf.push_back((unsigned char)((v >> 24) & 0xFF));
+	buf.push_back((unsigned char)((v >> 16) & 0xFF));
+	buf.push_back((unsigned char)((v >> 8) & 0xFF));
+	buf.push_back((unsigned char)(v & 0xFF));
+}
+
+void encoder::patch32(size_t pos, ul4 v)
+{
+	buf[pos]   = (unsigned char)((v >> 24) & 0xFF);
+	buf[pos+1] = (unsigned char)((v >> 16) & 0xFF);
+	buf[pos+2] = (unsigned char)((v >> 8) & 0xFF);
+	buf[pos+3] = (unsigned char)(v & 0xFF);
+}
+
+void encoder::version()
+{
+	put8(ERL_VERSION_MAGIC);
+}
+
+void encoder::tuple_header(unsigned int arity)
+{
+	if (arity < 256) {
+		put8(ERL_SMALL_TUPLE_EXT);
+		put8((unsigned char)arity);
+	} else {
+		put8(ERL_LARGE_TUPLE_EXT);
+		put32(arity);
+	}
+}
+
+void encoder::atom(const char * a)
+{
+	size_t len = strlen(a);
+	put8(ERL_ATOM_EXT);
+	put8((unsigned char)((len >> 8) & 0xFF));
+	put8((unsigned char)(len & 0xFF));
+	buf.insert(buf.end(), a, a + len);
+}
+
+void encoder::binary(const char * b, size_t len)
+{
+	put8(ERL_BINARY_EXT);
+	put32((ul4)len);
+	if (len > 0)
+		buf.insert(buf.end(), b, b + len);
+}
+
+void encoder::raw(const unsigned char * b, size_t len)
+{
+	buf.insert(buf.end(), b, b + len);
+}
+
+void encoder::integer(long long v)
+{
+	if (v >= 0 && v < 256) {
+		put8(ERL_SMALL_INTEGER_EXT);
+		put8((unsigned char)v);
+	} else if (v >= -2147483647LL-1 && v <= 2147483647LL) {
+		put8(ERL_INTEGER_EXT);
+		put32((ul4)(long)v);
+	} else {
+		unsigned long long u = (v < 0 ? (unsigned long long)(-(v+1))+1 : (unsigned long long)v);
+		size_t pos = buf.size();
+		put8(ERL_SMALL_BIG_EXT);
+		put8(0);
+		put8(v < 0 ? 1 : 0);
+		unsigned char n = 0;
+		for (; u > 0; u >>= 8, ++n)
+			put8((unsigned char)(u & 0xFF));
+		buf[pos+1] = n;
+	}
+}
+
+void encoder::uinteger(unsigned long long v)
+{
+	if (v <= 2147483647ULL) {
+		integer((long long)v);
+	} else {
+		size_t pos = buf.size();
+		put8(ERL_SMALL_BIG_EXT);
+		put8(0);
+		put8(0);
+		unsigned char n = 0;
+		for (; v > 0; v >>= 8, ++n)
+			put8((unsigned char)(v & 0xFF));
+		buf[pos+1] = n;
+	}
+}
+
+void encoder::dbl(double d)
+{
+	union {
+		double d;
+		unsigned long long u;
+	} v;
+	v.d = d;
+	put8(NEW_FLOAT_EXT);
+	for (int s = 56; s >= 0; s -= 8)
+		put8((unsigned char)((v.u >> s) & 0xFF));
+}
+
+void encoder::add(term & t)
+{
+	transcoder::instance().append(t, buf);
+}
+
+void encoder::open_rows()
+{
+	put8(ERL_LIST_EXT);
+	rows_pos = buf.size();
+	put32(0);
+	row_count = 0;
+	row_pos = 0;
+}
+
+void encoder::open_row()
+{
+	if (row_pos) {
+		patch32(row_pos, cell_count);
+		put8(ERL_NIL_EXT);
+	}
+	++row_count;
+	row_start = buf.size();
+	put8(ERL_LIST_EXT);
+	row_pos = buf.size();
+	put32(0);
+	cell_count = 0;
+}
+
+unsigned int encoder::close_rows()
+{
+	if (row_pos) {
+		patch32(row_pos, cell_count);
+		put8(ERL_NIL_EXT);
+		row_pos = 0;
+	}
+	if (row_count == 0) {
+		// no rows, the empty list is a plain NIL
+		buf.resize(rows_pos - 1);
+	} else
+		patch32(rows_pos, row_count);
+	put8(ERL_NIL_EXT);
+	return row_count;
+}
@@ -0,0 +1,69 @@
+/* Copyright 2014 K2Informatics GmbH, Root Laengenbold, Switzerland
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */ 
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <vector>
+
+#include "platform.h"
+#include "term.h"
+
+using namespace std;
+
+/*
+ * Writes erlang external term format straight into one growable buffer,
+ * used for responses too large to be worth building as a term tree first.
+ * Lists are written with a placeholder length which is patched on close.
+ */
+class encoder
+{
+private:
+	vector<unsigned char> buf;
+	size_t rows_pos;		// length field of the rows list
+	unsigned int row_count;
+	size_t row_pos;			// length field of the current row
+	size_t row_start;
+	unsigned int cell_count;
+
+	inline void put8(unsigned char b) { buf.push_back(b); };
+	void put32(ul4);
+	void patch32(size_t, ul4);
+
+public:
+	encoder(size_t reserve = 0);
+
+	inline vector<unsigned char> & buffer() { return buf; };
+	inline size_t size() { return buf.size(); };
+
+	void version(void);
+	void tuple_header(unsigned int arity);
+	void atom(const char *);
+	void binary(const char *, size_t);
+	void integer(long long);
+	void uinteger(unsigned long long);
+	void dbl(double);
+	void add(term &);
+	// an already encoded term, e.g. copied from a request
+	void raw(const unsigned char *, size_t);
+
+	// list of rows, each a list of cells
+	void open_rows(void);
+	void open_row(void);
+	inline void cell(void) { ++cell_count; };
+	inline size_t row_bytes(void) { return row_pos ? buf.size() - row_start : 0; };
+	unsigned int close_rows(void);
+};
+
+#endif // ENCODER_H
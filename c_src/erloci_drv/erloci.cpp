@@ -16,10 +16,12 @@
 #include "logger.h"
 
 #include "port.h"
+#include "evloop.h"
 #include "cmd_queue.h"
 #include "transcoder.h"
 #include "threads.h"
 #include "marshal.h"
+#include "ocisession.h"
 
 bool log_flag;
 
@@ -69,19 +71,77 @@ int main(int argc, char * argv[])
 		}
 	}
 
+	// Optional key=value configs
+	unsigned int spool_min = 1, spool_max = 16, spool_incr = 1, stmt_cache = 32;
+	unsigned int fetch_latency = FETCH_LATENCY_MS, ctl_workers = 2, ctl_weight = 4;
+	unsigned int workers = 0, max_workers = 0, nonblocking = 0;
+	size_t queue_max = QUEUE_MAX_CMDS, queue_max_bytes = QUEUE_MAX_BYTES;
+	for (int i = 4; i < argc; ++i) {
+		const char * val = strchr(argv[i], '=');
+		if (val == NULL) {
+			REMOTE_LOG(ERR, "ignoring malformed config %s", argv[i]);
+			continue;
+		}
+		++val;
+		if (strncmp(argv[i], "spool_min=", val - argv[i]) == 0)
+			spool_min = atol(val);
+		else if (strncmp(argv[i], "spool_max=", val - argv[i]) == 0)
+			spool_max = atol(val);
+		else if (strncmp(argv[i], "spool_incr=", val - argv[i]) == 0)
+			spool_incr = atol(val);
+		else if (strncmp(argv[i], "stmt_cache=", val - argv[i]) == 0)
+			stmt_cache = atol(val);
+		else if (strncmp(argv[i], "fetch_latency=", val - argv[i]) == 0)
+			fetch_latency = atol(val);
+		else if (strncmp(argv[i], "workers=", val - argv[i]) == 0)
+			workers = atol(val);
+		else if (strncmp(argv[i], "max_workers=", val - argv[i]) == 0)
+			max_workers = atol(val);
+		else if (strncmp(argv[i], "queue_max=", val - argv[i]) == 0)
+			queue_max = strtoul(val, NULL, 10);
+		else if (strncmp(argv[i], "queue_max_bytes=", val - argv[i]) == 0)
+			queue_max_bytes = strtoul(val, NULL, 10);
+		else if (strncmp(argv[i], "ctl_workers=", val - argv[i]) == 0)
+			ctl_workers = atol(val);
+		else if (strncmp(argv[i], "ctl_weight=", val - argv[i]) == 0)
+			ctl_weight = atol(val);
+		else if (strncmp(argv[i], "nonblocking=", val - argv[i]) == 0)
+			nonblocking = atol(val);
+		else
+			REMOTE_LOG(ERR, "ignoring unknown config %s", argv[i]);
+	}
+	ocisession::pool_config(spool_min, spool_max, spool_incr);
+	ocisession::stmt_cache_config(stmt_cache);
+	ocistmt::fetch_config(fetch_latency);
+	threads::config(workers, max_workers, ctl_workers);
+	cmd_queue::config(ctl_weight, queue_max, queue_max_bytes);
+#ifndef __WIN32__
+	// parked calls are polled from the event loop
+	cmd_queue::park_config(nonblocking);
+	ocisession::nonblocking_config(nonblocking > 0);
+#endif
+
 	REMOTE_LOG(INF, "Port process configs : erlang term max size 0x%08X bytes, logging %s, TCP port for logs %d"
 		, max_term_byte_size, (log_flag ? "enabled" : "disabled"), log_tcp_port);
-	threads::init();
+#ifdef __WIN32__
 	port& prt = port::instance();
+	prt.start_writer();
+	threads::init();
 	vector<unsigned char> read_buf;
 
 	while(prt.read_cmd(read_buf) > 0) {
 		cmd_queue::push(read_buf);
-#ifndef USING_THREAD_POOL
-		threads::start();
-#endif
     }
+#else
+	if (evloop::init()) {
+		REMOTE_LOG(CRT, "event loop init failed");
+		return -1;
+	}
+	threads::init();
+	evloop::run();
+#endif
 	threads::run_threads = false;
+	cmd_queue::close();
 
 	REMOTE_LOG(DBG, "erloci terminating...");
     return 0;
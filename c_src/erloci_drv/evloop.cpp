@@ -0,0 +1,201 @@
+/* Copyright 2014 K2Informatics GmbH, Root Laengenbold, Switzerland
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "evloop.h"
+
+#ifndef __WIN32__
+
+#include "port.h"
+#include "logger.h"
+#include "marshal.h"
+
+#include <fcntl.h>
+#include <errno.h>
+
+evloop evloop::self;
+
+evloop::evloop(void)
+{
+	base = NULL;
+	wake_fd[0] = wake_fd[1] = -1;
+	out_armed = false;
+	log_armed = false;
+}
+
+static bool set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	return (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0);
+}
+
+bool evloop::init(void)
+{
+	port & p = port::instance();
+
+	if (INIT_LOCK(self.tmr_lock))
+		return true;
+	if (pipe(self.wake_fd) != 0)
+		return true;
+	if (set_nonblocking(self.wake_fd[0]) || set_nonblocking(self.wake_fd[1])
+		|| set_nonblocking(p.in_fd()) || set_nonblocking(p.out_fd()))
+		return true;
+	if (logger::sock_fd() >= 0 && set_nonblocking(logger::sock_fd()))
+		return true;
+
+	if (NULL == (self.base = event_base_new()))
+		return true;
+
+	event_set(&self.in_ev, p.in_fd(), EV_READ | EV_PERSIST, on_stdin, NULL);
+	event_base_set(self.base, &self.in_ev);
+	event_set(&self.wake_ev, self.wake_fd[0], EV_READ | EV_PERSIST, on_wake, NULL);
+	event_base_set(self.base, &self.wake_ev);
+	if (event_add(&self.in_ev, NULL) != 0 || event_add(&self.wake_ev, NULL) != 0)
+		return true;
+
+	// armed only while a write would block
+	event_set(&self.out_ev, p.out_fd(), EV_WRITE | EV_PERSIST, on_writable, NULL);
+	event_base_set(self.base, &self.out_ev);
+	if (logger::sock_fd() >= 0) {
+		event_set(&self.log_ev, logger::sock_fd(), EV_WRITE | EV_PERSIST, on_writable, NULL);
+		event_base_set(self.base, &self.log_ev);
+	}
+
+	return false;
+}
+
+void evloop::run(void)
+{
+	// responses and logs queued before the loop started
+	self.flush();
+	event_base_dispatch(self.base);
+}
+
+void evloop::notify(void)
+{
+	if (self.wake_fd[1] < 0)
+		return;
+	// a full pipe already wakes the loop
+	char c = 0;
+	while (write(self.wake_fd[1], &c, 1) < 0 && errno == EINTR)
+		;
+}
+
+void evloop::timer(unsigned int ms, timer_fn fn, void * arg)
+{
+	(void) timeout(ms, fn, NULL, arg);
+}
+
+evtimer_req * evloop::timeout(unsigned int ms, timer_fn fn, timer_fn release, void * arg)
+{
+	evtimer_req * t = new evtimer_req;
+	t->ms = ms;
+	t->fn = fn;
+	t->release = release;
+	t->arg = arg;
+	if (LOCK(self.tmr_lock)) {
+		self.tmr_new.push_back(t);
+		UNLOCK(self.tmr_lock);
+	}
+	notify();
+	return t;
+}
+
+void evloop::cancel(evtimer_req * t)
+{
+	if (LOCK(self.tmr_lock)) {
+		self.tmr_del.push_back(t);
+		UNLOCK(self.tmr_lock);
+	}
+	notify();
+}
+
+void evloop::on_stdin(int fd, short what, void * arg)
+{
+	if (port::instance().read_ready() < 0)
+		event_base_loopbreak(self.base);
+}
+
+void evloop::on_writable(int fd, short what, void * arg)
+{
+	self.flush();
+}
+
+void evloop::on_wake(int fd, short what, void * arg)
+{
+	char drain[256];
+	while (read(fd, drain, sizeof(drain)) > 0)
+		;
+
+	vector<evtimer_req *> tmrs, dels;
+	if (LOCK(self.tmr_lock)) {
+		tmrs.swap(self.tmr_new);
+		dels.swap(self.tmr_del);
+		UNLOCK(self.tmr_lock);
+	}
+	for (size_t i = 0; i < tmrs.size(); ++i) {
+		evtimer_req * t = tmrs[i];
+		struct timeval tv;
+		tv.tv_sec = t->ms / 1000;
+		tv.tv_usec = (t->ms % 1000) * 1000;
+		evtimer_set(&t->ev, on_timer, t);
+		event_base_set(self.base, &t->ev);
+		evtimer_add(&t->ev, &tv);
+	}
+	// armed above at the latest, a fired one is no longer pending
+	for (size_t i = 0; i < dels.size(); ++i) {
+		evtimer_req * t = dels[i];
+		evtimer_del(&t->ev);
+		(*t->release)(t->arg);
+		delete t;
+	}
+
+	self.flush();
+}
+
+void evloop::on_timer(int fd, short what, void * arg)
+{
+	evtimer_req * t = (evtimer_req *)arg;
+	(*t->fn)(t->arg);
+	if (t->release == NULL)
+		delete t;
+}
+
+void evloop::arm(struct event * ev, bool & armed, bool want)
+{
+	if (want && !armed)
+		event_add(ev, NULL);
+	else if (!want && armed)
+		event_del(ev);
+	armed = want;
+}
+
+// writes whatever the workers and the logger queued, waits for
+// writability only while a write would block
+void evloop::flush(void)
+{
+	int r = port::instance().flush();
+	if (r < 0) {
+		REMOTE_LOG(CRT, "response write failed, shutting down port\n");
+		exit(1);
+	}
+	arm(&out_ev, out_armed, r == 0);
+
+	if (logger::sock_fd() >= 0) {
+		// a broken log socket only loses logs
+		r = logger::flush();
+		arm(&log_ev, log_armed, r == 0);
+	}
+}
+
+#endif // __WIN32__
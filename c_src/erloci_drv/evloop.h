@@ -0,0 +1,84 @@
+/* Copyright 2014 K2Informatics GmbH, Root Laengenbold, Switzerland
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include "platform.h"
+
+// Windows keeps the blocking stdin reader in main and the writer thread
+#ifndef __WIN32__
+
+#include <vector>
+
+using namespace std;
+
+typedef void (*timer_fn)(void *);
+
+// One-shot timer requested from any thread
+typedef struct evtimer_req {
+	struct event ev;
+	unsigned int ms;
+	timer_fn fn;
+	timer_fn release;	// of arg, once cancelled, timers without one are freed as they fire
+	void * arg;
+} evtimer_req;
+
+// libevent loop of the main thread, multiplexes stdin, stdout, the log
+// socket, timers and the wakeups of the workers through a self-pipe
+class evloop
+{
+private:
+	static evloop self;
+	struct event_base * base;
+	struct event in_ev;
+	struct event out_ev;
+	struct event log_ev;
+	struct event wake_ev;
+	int wake_fd[2];
+	bool out_armed;
+	bool log_armed;
+	mutex_type tmr_lock;
+	vector<evtimer_req *> tmr_new;	// requested by other threads, armed by the loop
+	vector<evtimer_req *> tmr_del;	// cancelled by other threads, removed by the loop
+
+	evloop(void);
+	evloop(evloop const&);			// Not implemented
+    void operator=(evloop const&);	// Not implemented
+
+	static void on_stdin(int, short, void *);
+	static void on_writable(int, short, void *);
+	static void on_wake(int, short, void *);
+	static void on_timer(int, short, void *);
+	void arm(struct event *, bool &, bool);
+	void flush(void);
+
+public:
+	// true on failure
+	static bool init(void);
+	// returns once stdin is closed
+	static void run(void);
+	// called by any thread after queueing a response or a log
+	static void notify(void);
+	// fn(arg) runs on the loop thread after ms
+	static void timer(unsigned int ms, timer_fn fn, void * arg);
+	// as timer, but the timer stays until cancel, which removes it if it
+	// did not fire yet and then calls release(arg) on the loop thread
+	static evtimer_req * timeout(unsigned int ms, timer_fn fn, timer_fn release, void * arg);
+	static void cancel(evtimer_req * t);
+};
+
+#endif // __WIN32__
+
+#endif // EVLOOP_H
@@ -16,6 +16,7 @@
 #include "logger.h"
 #include "term.h"
 #include "transcoder.h"
+#include "evloop.h"
 
 void log_remote(const char * filename, const char * funcname, unsigned int linenumber, unsigned int level, void *term, const char *fmt, ...)
 {
@@ -99,6 +100,7 @@ const char * logger::init(int port)
 	if (INIT_LOCK(self.log_lock)) {
         return "Log write Mutex creation failed\n";
     }
+	self.connected = true;
 
 	return NULL; //Success
 }
@@ -128,8 +130,27 @@ void logger::log(const char * filename, const char * funcname, unsigned int line
 
 	vector<unsigned char> log = transcoder::instance().encode_with_header(t);
 
+	if (!self.connected)
+		return;
+#ifdef __WIN32__
     if(self.lock()) {
 		send(self.log_sock, (char*) &log[0], (int)log.size(), 0);
 		self.unlock();
     }
+#else
+	if (self.logq.push(log, false))
+		evloop::notify();
+#endif
 }
+
+#ifndef __WIN32__
+// logs that can not be written are dropped, as send() did
+int logger::flush(void)
+{
+	self.logq.take();
+	int r = self.logq.flush(self.log_sock);
+	if (r < 0)
+		self.logq.clear();
+	return r;
+}
+#endif
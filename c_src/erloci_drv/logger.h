@@ -16,6 +16,7 @@
 #define LOGGER_H
 
 #include "platform.h"
+#include "out_queue.h"
 
 class logger
 {
@@ -24,6 +25,10 @@ private:
 
 	mutex_type log_lock;
 	sock log_sock; //Socket handle
+	bool connected;
+#ifndef __WIN32__
+	out_queue logq; // written by the event loop
+#endif
 
 	logger(void) {};
 	logger(logger const&);         // Not implemented
@@ -35,6 +40,11 @@ private:
 public:
 	static const char * init(int);
 	static void log(const char *, const char *, unsigned int, unsigned int, void *, const char *);
+#ifndef __WIN32__
+	// event loop side, the socket is non blocking
+	static inline int sock_fd(void) { return self.connected ? self.log_sock : -1; };
+	static int flush(void);
+#endif
 
 	~logger(void);
 };
@@ -13,6 +13,8 @@
  * limitations under the License.
  */ 
 #include "marshal.h"
+#include "encoder.h"
+#include "transcoder.h"
 #include "erl_interface.h"
 
 #include <ocidfn.h>
@@ -37,10 +39,11 @@
 
 const erlcmdtable cmdtbl[] = CMDTABLE;
 
+// encoded size of a row appended by child_list
 size_t calculate_resp_size(void * resp)
 {
-    //return (size_t)erl_term_len(*(ETERM**)resp);
-	return 1;
+	ASSERT(resp!=NULL);
+	return transcoder::instance().encoded_size(*(term *)resp);
 }
 
 #if DEBUG < DBG_5
@@ -201,6 +204,20 @@ void append_cur_arg_tuple_to_list(const unsigned char * val, unsigned long long
 	_t1.insert().integer(ival2);
 }
 
+void append_err_tuple_to_list(unsigned long long row, int code, const char * msg, size_t len, void * list)
+{
+	ASSERT(list!=NULL);
+
+    term *container_list = (term *)list;
+    ASSERT(container_list->is_list());
+
+	term & _t = container_list->insert();
+	_t.tuple();
+	_t.insert().integer(row);
+	_t.insert().integer(code);
+	_t.insert().binary(msg, len);
+}
+
 void append_tuple_to_list(unsigned long long ptr, unsigned long long len, void * list)
 {
 	ASSERT(list!=NULL);
@@ -297,10 +314,10 @@ void map_schema_to_bind_args(term & t, vector<var> & vars)
 			&& (*it)[2].is_any_int());
 
 		if(sizeof(v.name) < (*it)[0].str_len+1) {
-			REMOTE_LOG(ERR, "variable %s is too long, max %d\n", &(*it)[0].str[0], sizeof(v.name)-1);
+			REMOTE_LOG(ERR, "variable %.*s is too long, max %d\n", (int)(*it)[0].str_len, (*it)[0].str(), sizeof(v.name)-1);
 			throw string("variable name is larger then 255 characters");
 		}
-		strncpy(v.name, &((*it)[0].str[0]), (*it)[0].str_len);
+		strncpy(v.name, (*it)[0].str(), (*it)[0].str_len);
 		v.name[(*it)[0].str_len]='\0';
 
 		// Direction in / out / in out (ARG_DIR)
@@ -312,11 +329,34 @@ void map_schema_to_bind_args(term & t, vector<var> & vars)
 		v.value_sz = 0;
 		v.datap = NULL;
 		v.datap_len = 0;
+		v.datap_cap = 0;
 
 		vars.push_back(v);
 	}
 }
 
+// value_sz and alen are ub2
+#define BIND_VALUE_MAX	0xFFFF
+
+// fixed bind buffer width of a type, 0 for variable length types
+static unsigned short fixed_bind_size(unsigned short dty)
+{
+	switch(dty) {
+		case SQLT_FLT:
+		case SQLT_BFLOAT:
+		case SQLT_IBFLOAT:
+			return sizeof(float);
+		case SQLT_IBDOUBLE:
+		case SQLT_BDOUBLE:
+			return sizeof(double);
+		case SQLT_NUM:
+		case SQLT_INT:
+			return sizeof(int);
+		default:
+			return 0;
+	}
+}
+
 size_t map_value_to_bind_args(term & t, vector<var> & vars)
 {
 	ASSERT(t.is_list());
@@ -324,43 +364,75 @@ size_t map_value_to_bind_args(term & t, vector<var> & vars)
 
 	intf_ret r;	
 	r.fn_ret = CONTINUE_WITH_ERROR;
+	r.gerrcode = 0;
 
-	void * tmp_arg = NULL;
-	sb2 ind = -1; // set to NULL as default
-	size_t arg_len = 0;
-	
-	// remove any old bind from the vars
-	for(unsigned int i=0; i < vars.size(); ++i) {
-		vars[i].valuep.clear();
-		vars[i].alen.clear();
-	}
-	
-	// loop through the list
-	size_t bind_count = 0;
+	// first pass: validate rows and find the widest value of every column
+	// so that each column buffer is sized only once
+	vector<size_t> max_len(vars.size(), 0);
+	size_t row_count = 0;
 	for (term::iterator it = t.begin() ; it != t.end(); ++it) {
-		++bind_count;
+		++row_count;
 		term & t1 = (*it);
         if (!t1.is_tuple() || t1.length() != vars.size()) {
 			REMOTE_LOG(ERR, "malformed ETERM\n");
 			strcpy(r.gerrbuf, "Malformed ETERM");
             throw r;
 		}
+		int i = 0;
+		for (term::iterator it1 = t1.begin(); it1 != t1.end(); ++it1, ++i) {
+			term & t2 = (*it1);
+			if (t2.is_binary()) {
+				size_t len = t2.str_len + (vars[i].dty == SQLT_STR ? 1 : 0);
+				if (len > BIND_VALUE_MAX) {
+					REMOTE_LOG(ERR, "row %u: value of %u bytes for %s, max %u\n", row_count, len, vars[i].name, BIND_VALUE_MAX);
+					sprintf(r.gerrbuf, "Bind value for %.255s longer than %u bytes", vars[i].name, BIND_VALUE_MAX);
+					throw r;
+				}
+				if (len > max_len[i])
+					max_len[i] = len;
+			}
+		}
+	}
+
+	// size the column buffers, reusing the previous ones when large enough
+	for(unsigned int i=0; i < vars.size(); ++i) {
+		var & v = vars[i];
+		v.value_sz = fixed_bind_size(v.dty);
+		if (v.value_sz == 0)
+			v.value_sz = (unsigned short)(max_len[i] > 0 ? max_len[i] : 1);
+		v.datap_len = (unsigned long)(row_count * v.value_sz);
+		if (v.datap_len > v.datap_cap) {
+			free(v.datap);
+			v.datap = malloc(v.datap_len);
+			v.datap_cap = (v.datap == NULL ? 0 : v.datap_len);
+			if (v.datap == NULL) {
+				REMOTE_LOG(ERR, "failed to allocate %lu bytes bind buffer for %s\n", v.datap_len, v.name);
+				strcpy(r.gerrbuf, "Out of memory for bind buffer");
+				throw r;
+			}
+		}
+		v.alen.assign(row_count, 0);
+		v.ind.assign(row_count, -1); // NULL unless a value is found
+	}
+
+	// second pass: write every value into its final slot
+	size_t bind_count = 0;
+	for (term::iterator it = t.begin() ; it != t.end(); ++it) {
+		term & t1 = (*it);
 
 		// loop through each value of the tuple
 		int i = 0;
 		for (term::iterator it1 = t1.begin(); it1 != t1.end(); ++it1) {
 			term & t2 = (*it1);
 			if (t2.is_undef()) {
-				REMOTE_LOG(ERR, "row %d: missing parameter for %s\n", bind_count, vars[i].name);
+				REMOTE_LOG(ERR, "row %d: missing parameter for %s\n", bind_count+1, vars[i].name);
 				strcpy(r.gerrbuf, "Missing parameter term");
 				throw r;
 			}
-			
-			ind = -1; // assume the field to be deleted by setting NULL
-					  // set to zero when no trivial value for the field
-					  // is found
-			tmp_arg = NULL;
-			arg_len = 0;
+
+			char * slot = (char*)vars[i].datap + bind_count * vars[i].value_sz;
+			sb2 ind = -1;
+			size_t arg_len = 0;
 			switch(vars[i].dty) {
 				case SQLT_FLT:
 				case SQLT_BFLOAT:
@@ -368,10 +440,9 @@ size_t map_value_to_bind_args(term & t, vector<var> & vars)
 					if(t2.is_any_int() || t2.is_float()) {
 						ind = 0;
 						arg_len = sizeof(float);
-						tmp_arg = new float;
-						*(float*)tmp_arg = (float)(t2.is_any_int() ? t2.v.ll : t2.v.d);
+						*(float*)slot = (float)(t2.is_any_int() ? t2.v.ll : t2.v.d);
 					} else if (!t2.is_binary()) {
-						REMOTE_LOG(ERR, "row %d: malformed float for %s (expected INTEGER or FLOAT got %d)\n", bind_count, vars[i].name, (int)t2.type);
+						REMOTE_LOG(ERR, "row %d: malformed float for %s (expected INTEGER or FLOAT got %d)\n", bind_count+1, vars[i].name, (int)t2.type);
 						strcpy(r.gerrbuf, "Malformed float parameter value");
 						throw r;
 					}
@@ -381,10 +452,9 @@ size_t map_value_to_bind_args(term & t, vector<var> & vars)
 					if(t2.is_any_int() || t2.is_float()) {
 						ind = 0;
 						arg_len = sizeof(double);
-						tmp_arg = new double;
-						*(double*)tmp_arg = (double)(t2.is_any_int() ? t2.v.ll : t2.v.d);
+						*(double*)slot = (double)(t2.is_any_int() ? t2.v.ll : t2.v.d);
 					} else if (!t2.is_binary()) {
-						REMOTE_LOG(ERR, "row %d: malformed float for %s (expected INTEGER or FLOAT got %d)\n", bind_count, vars[i].name, (int)t2.type);
+						REMOTE_LOG(ERR, "row %d: malformed float for %s (expected INTEGER or FLOAT got %d)\n", bind_count+1, vars[i].name, (int)t2.type);
 						strcpy(r.gerrbuf, "Malformed float parameter value");
 						throw r;
 					}
@@ -394,10 +464,9 @@ size_t map_value_to_bind_args(term & t, vector<var> & vars)
 					if(t2.is_any_int()) {
 						ind = 0;
 						arg_len = sizeof(int);
-						tmp_arg = new int;
-						*(int*)tmp_arg = t2.v.i;
+						*(int*)slot = t2.v.i;
 					} else if (!t2.is_binary()) {
-						REMOTE_LOG(ERR, "row %d: malformed integer for %s (expected INTEGER)\n", bind_count, vars[i].name);
+						REMOTE_LOG(ERR, "row %d: malformed integer for %s (expected INTEGER)\n", bind_count+1, vars[i].name);
 						strcpy(r.gerrbuf, "Malformed integer parameter value");
 						throw r;
 					}
@@ -405,11 +474,10 @@ size_t map_value_to_bind_args(term & t, vector<var> & vars)
 				case SQLT_VNU:
 					if(t2.is_binary() && t2.str_len > 0 && t2.str_len <= OCI_NUMBER_SIZE) {
 						ind = 0;
-						arg_len = t2.str_len;
-						tmp_arg = new char[arg_len];
-						memcpy(tmp_arg, &t2.str[0], arg_len);
+						arg_len = min(t2.str_len, (size_t)vars[i].value_sz);
+						memcpy(slot, t2.str(), arg_len);
 					} else if (!t2.is_binary()) {
-						REMOTE_LOG(ERR, "row %d: malformed number for %s (expected BINARY)\n", bind_count, vars[i].name);
+						REMOTE_LOG(ERR, "row %d: malformed number for %s (expected BINARY)\n", bind_count+1, vars[i].name);
 						strcpy(r.gerrbuf, "Malformed number parameter value");
 						throw r;
 					}
@@ -424,11 +492,10 @@ size_t map_value_to_bind_args(term & t, vector<var> & vars)
 				case SQLT_RDD:
 					if(t2.is_binary() && t2.str_len > 0) {
 						ind = 0;
-						arg_len = t2.str_len;
-						tmp_arg = new char[arg_len];
-						memcpy(tmp_arg, &t2.str[0], arg_len);
+						arg_len = min(t2.str_len, (size_t)vars[i].value_sz);
+						memcpy(slot, t2.str(), arg_len);
 					} else if (!t2.is_binary()) {
-						REMOTE_LOG(ERR, "row %d: malformed binary for %s (expected BINARY)\n", bind_count, vars[i].name);
+						REMOTE_LOG(ERR, "row %d: malformed binary for %s (expected BINARY)\n", bind_count+1, vars[i].name);
 						strcpy(r.gerrbuf, "Malformed binary parameter value");
 						throw r;
 					}
@@ -436,12 +503,11 @@ size_t map_value_to_bind_args(term & t, vector<var> & vars)
 				case SQLT_ODT:
 					if(t2.is_binary() && t2.str_len > 0) {
 						ind = 0;
-						arg_len = t2.str_len;
-						tmp_arg = new char[arg_len];
-						memcpy(tmp_arg, &t2.str[0], arg_len);
-						((OCIDate*)tmp_arg)->OCIDateYYYY = htons((ub2)((OCIDate*)tmp_arg)->OCIDateYYYY);
+						arg_len = min(t2.str_len, (size_t)vars[i].value_sz);
+						memcpy(slot, t2.str(), arg_len);
+						((OCIDate*)slot)->OCIDateYYYY = htons((ub2)((OCIDate*)slot)->OCIDateYYYY);
 					} else if (!t2.is_binary()) {
-						REMOTE_LOG(ERR, "row %d: malformed date for %s (expected BINARY)\n", bind_count, vars[i].name);
+						REMOTE_LOG(ERR, "row %d: malformed date for %s (expected BINARY)\n", bind_count+1, vars[i].name);
 						strcpy(r.gerrbuf, "Malformed date parameter value");
 						throw r;
 					}
@@ -452,11 +518,10 @@ size_t map_value_to_bind_args(term & t, vector<var> & vars)
 				case SQLT_BIN:
 					if(t2.is_binary() && t2.str_len > 0) {
 						ind = 0;
-						arg_len = t2.str_len;
-						tmp_arg = new char[arg_len];
-						memcpy(tmp_arg, &t2.str[0], arg_len);
+						arg_len = min(t2.str_len, (size_t)vars[i].value_sz);
+						memcpy(slot, t2.str(), arg_len);
 					} else if (!t2.is_binary()) {
-						REMOTE_LOG(ERR, "row %d: malformed string for %s (expected BINARY)\n", bind_count, vars[i].name);
+						REMOTE_LOG(ERR, "row %d: malformed string for %s (expected BINARY)\n", bind_count+1, vars[i].name);
 						strcpy(r.gerrbuf, "Malformed string parameter value");
 						throw r;
 					}
@@ -464,13 +529,12 @@ size_t map_value_to_bind_args(term & t, vector<var> & vars)
 				case SQLT_STR:
 					if(t2.is_binary() && t2.str_len > 0) {
 						ind = 0;
-						arg_len = t2.str_len;
-						tmp_arg = new char[arg_len+1];
-						memcpy(tmp_arg, &t2.str[0], arg_len);
-						((char*)tmp_arg)[arg_len] = '\0';
+						arg_len = min(t2.str_len, (size_t)vars[i].value_sz - 1);
+						memcpy(slot, t2.str(), arg_len);
+						slot[arg_len] = '\0';
 						arg_len++;
 					} else if (!t2.is_binary()) {
-						REMOTE_LOG(ERR, "row %d: malformed string\\0 for %s (expected BINARY)\n", bind_count, vars[i].name);
+						REMOTE_LOG(ERR, "row %d: malformed string\\0 for %s (expected BINARY)\n", bind_count+1, vars[i].name);
 						strcpy(r.gerrbuf, "Malformed string\\0 parameter value");
 						throw r;
 					}
@@ -480,13 +544,11 @@ size_t map_value_to_bind_args(term & t, vector<var> & vars)
 					throw r;
 					break;
 			}
-			vars[i].alen.push_back((unsigned short)arg_len);
-			if (arg_len > vars[i].value_sz)
-				vars[i].value_sz = (unsigned short)arg_len;
-			vars[i].valuep.push_back(tmp_arg);
-			vars[i].ind.push_back(ind);
+			vars[i].alen[bind_count] = (unsigned short)arg_len;
+			vars[i].ind[bind_count] = ind;
 			++i;
 		}
+		++bind_count;
     }
 
 	return bind_count;
@@ -506,5 +568,91 @@ intf_funs marshall_intf_funs = {
 	child_list,
 	append_bin_arg_tuple_to_list,
 	append_int_arg_tuple_to_list,
-	append_cur_arg_tuple_to_list
-};
\ No newline at end of file
+	append_cur_arg_tuple_to_list,
+	append_err_tuple_to_list
+};
+/*
+ * Row callbacks writing into an encoder instead of a term, only what
+ * ocistmt::rows needs is available
+ */
+size_t stream_resp_size(void * stream)
+{
+	return ((encoder *)stream)->row_bytes();
+}
+
+void stream_append_int(const int integer, void * stream)
+{
+	encoder *e = (encoder *)stream;
+	e->integer(integer);
+	e->cell();
+}
+
+void stream_append_float(const unsigned char flt[4], void * stream)
+{
+	encoder *e = (encoder *)stream;
+	e->dbl(ntohf(flt));
+	e->cell();
+}
+
+void stream_append_double(const unsigned char dbl[8], void * stream)
+{
+	encoder *e = (encoder *)stream;
+	e->dbl(ntohd(dbl));
+	e->cell();
+}
+
+void stream_append_string(const char * string, size_t len, void * stream)
+{
+	encoder *e = (encoder *)stream;
+	if (string) {
+		e->binary(string, len);
+		e->cell();
+	}
+}
+
+void stream_append_tuple(unsigned long long ptr, unsigned long long len, void * stream)
+{
+	encoder *e = (encoder *)stream;
+	e->tuple_header(2);
+	e->uinteger(ptr);
+	e->uinteger(len);
+	e->cell();
+}
+
+void stream_append_ext_tuple(unsigned long long ptr, unsigned long long len,
+	const char * dir, unsigned long long dlen,
+	const char * file, unsigned long long flen,
+	void * stream)
+{
+	encoder *e = (encoder *)stream;
+	e->tuple_header(4);
+	e->uinteger(ptr);
+	e->uinteger(len);
+	e->binary(dir, (size_t)dlen);
+	e->binary(file, (size_t)flen);
+	e->cell();
+}
+
+void * stream_child_list(void * stream)
+{
+	((encoder *)stream)->open_row();
+	return stream;
+}
+
+intf_funs marshall_stream_funs = {
+	stream_resp_size,
+	stream_append_int,
+	stream_append_float,
+	stream_append_double,
+	stream_append_string,
+	stream_append_tuple,
+	stream_append_ext_tuple,
+	NULL,
+	NULL,
+	NULL,
+	stream_child_list,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
@@ -68,7 +68,10 @@ typedef enum _ERL_CMD {
 	CMD_DSCRB	= 11,
 	GET_LOBDA	= 12,
 	CMD_ECHOT	= 13,
-	SESN_PING	= 14
+	SESN_PING	= 14,
+	PORT_STAT	= 15,
+	CMD_CANCEL	= 16,
+	WARM_POOL	= 17
 } ERL_CMD;
 
 /*
@@ -96,6 +99,9 @@ extern const erlcmdtable cmdtbl[];
     {GET_LOBDA,	"GET_LOBDA",	6, "Get data from a LOB object"},\
     {CMD_ECHOT,	"CMD_ECHOT",	2, "Echo back erlang term"},\
     {SESN_PING,	"SESN_PING",	2, "Pings OCI session"},\
+    {PORT_STAT,	"PORT_STAT",	1, "Port process statistics"},\
+    {CMD_CANCEL,	"CMD_CANCEL",	3, "Interrupt the running statement of a session"},\
+    {WARM_POOL,	"WARM_POOL",	4, "Create the session pool of a connection"},\
 }
 
 #include "lib_interface.h"
@@ -131,5 +137,6 @@ extern void log_args(int, void *, const char *);
 #endif
 
 extern intf_funs marshall_intf_funs;
+extern intf_funs marshall_stream_funs;
 
 #endif // OCI_MARSHAL_H
\ No newline at end of file
@@ -0,0 +1,162 @@
+/* Copyright 2014 K2Informatics GmbH, Root Laengenbold, Switzerland
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "out_queue.h"
+
+#ifndef __WIN32__
+#include <errno.h>
+#include <sys/uio.h>
+#endif
+
+out_queue::out_queue(void)
+{
+	head = NULL;
+	pend = NULL;
+	pend_tail = NULL;
+	pend_off = 0;
+}
+
+out_queue::~out_queue(void)
+{
+	clear();
+}
+
+void out_queue::clear(void)
+{
+	take();
+	while (pend != NULL) {
+		out_node * n = pend->next;
+		delete pend;
+		pend = n;
+	}
+	pend_tail = NULL;
+	pend_off = 0;
+}
+
+bool out_queue::push(vector<unsigned char> & buf, bool with_len)
+{
+	out_node * n = new out_node;
+	n->len = htonl((ul4)buf.size());
+	n->has_len = with_len;
+	n->data.swap(buf);
+
+	out_node * old;
+	do {
+		old = head;
+		n->next = old;
+	} while (!CAS_PTR(&head, old, n));
+	return old == NULL;
+}
+
+bool out_queue::take(void)
+{
+	out_node * batch = (out_node *)XCHG_PTR(&head, (out_node *)NULL);
+	out_node * tail = batch;
+	out_node * fifo = NULL;
+	while (batch != NULL) {
+		out_node * n = batch->next;
+		batch->next = fifo;
+		fifo = batch;
+		batch = n;
+	}
+	if (fifo != NULL) {
+		if (pend_tail != NULL)
+			pend_tail->next = fifo;
+		else
+			pend = fifo;
+		pend_tail = tail;
+	}
+	return pend != NULL;
+}
+
+// drops the buffers (and the part of the next one) covered by wrote bytes
+void out_queue::consume(size_t wrote)
+{
+	while (pend != NULL) {
+		size_t left = (pend->has_len ? sizeof(ul4) : 0) + pend->data.size() - pend_off;
+		if (wrote < left) {
+			pend_off += wrote;
+			return;
+		}
+		wrote -= left;
+		out_node * n = pend->next;
+		delete pend;
+		pend = n;
+		pend_off = 0;
+	}
+	pend_tail = NULL;
+}
+
+#ifndef __WIN32__
+static void add_iov(struct iovec * iov, int & cnt, void * base, size_t len, size_t & skip)
+{
+	if (skip >= len) {
+		skip -= len;
+		return;
+	}
+	iov[cnt].iov_base = (char*)base + skip;
+	iov[cnt++].iov_len = len - skip;
+	skip = 0;
+}
+#endif
+
+int out_queue::flush(int fd)
+{
+#ifdef __WIN32__
+	// no writev, header and body are written one after the other
+	while (pend != NULL) {
+		size_t hl = (pend->has_len ? sizeof(ul4) : 0);
+		const char * p = NULL;
+		size_t l = 0;
+		if (pend_off < hl) {
+			p = (const char*)&pend->len + pend_off;
+			l = hl - pend_off;
+		} else if (pend_off - hl < pend->data.size()) {
+			p = (const char*)&pend->data[0] + (pend_off - hl);
+			l = pend->data.size() - (pend_off - hl);
+		}
+		int i = 0;
+		if (l > 0 && (i = write(fd, p, (unsigned int)l)) <= 0)
+			return -1;
+		consume(i);
+	}
+#else
+	struct iovec iov[WRITEV_MAX_IOV];
+	while (pend != NULL) {
+		int cnt = 0;
+		size_t skip = pend_off;
+		for (out_node * n = pend; n != NULL && cnt + 2 <= WRITEV_MAX_IOV; n = n->next) {
+			if (n->has_len)
+				add_iov(iov, cnt, &n->len, sizeof(ul4), skip);
+			if (n->data.size() > 0)
+				add_iov(iov, cnt, &n->data[0], n->data.size(), skip);
+		}
+		if (cnt == 0) {
+			consume(0);
+			continue;
+		}
+
+		ssize_t wrote = writev(fd, iov, cnt);
+		if (wrote < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		consume((size_t)wrote);
+	}
+#endif
+	return 1;
+}
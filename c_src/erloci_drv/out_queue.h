@@ -0,0 +1,63 @@
+/* Copyright 2014 K2Informatics GmbH, Root Laengenbold, Switzerland
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef OUT_QUEUE_H
+#define OUT_QUEUE_H
+
+#include "platform.h"
+
+#include <vector>
+
+using namespace std;
+
+#define WRITEV_MAX_IOV	64	// iovecs per writev, two per buffer
+
+// encoded buffer waiting to be written
+typedef struct out_node {
+	ul4 len;					// {packet,4} length header, network order
+	bool has_len;				// false if data carries its own header
+	vector<unsigned char> data;
+	struct out_node * next;
+} out_node;
+
+// Many producers push without a lock, the one consumer takes everything
+// pushed so far and writes it in FIFO order, several buffers per writev
+class out_queue
+{
+private:
+	out_node * volatile head;	// lock-free stack, newest first
+	out_node * pend;			// taken by the consumer, oldest first
+	out_node * pend_tail;
+	size_t pend_off;			// bytes of pend already written
+	void consume(size_t);
+
+	out_queue(out_queue const&);		// Not implemented
+    void operator=(out_queue const&);	// Not implemented
+
+public:
+	out_queue(void);
+	~out_queue(void);
+
+	// buf is taken over, true if the queue was empty and the consumer may sleep
+	bool push(vector<unsigned char> & buf, bool with_len);
+	// consumer only, moves the pushed buffers behind the pending ones
+	bool take(void);
+	// consumer only, 1 all written, 0 fd would block, -1 write failed
+	int flush(int fd);
+	inline bool pending(void) { return pend != NULL; };
+	// consumer only, drops what could not be written
+	void clear(void);
+};
+
+#endif // OUT_QUEUE_H
@@ -1,8 +1,6 @@
 #ifndef _PLATFORM_H_
 #define _PLATFORM_H_
 
-#define USING_THREAD_POOL
-
 #ifdef __WIN32__
 	#include <io.h>
 	#include <fcntl.h>
@@ -17,13 +15,23 @@
 
 	typedef u_long ul4;
 	typedef HANDLE mutex_type;
+	typedef HANDLE cond_type;
 	typedef SOCKET sock;
 
 	#define INIT_LOCK(_Lock)	(((_Lock) = CreateMutex(NULL, FALSE, NULL)) == NULL)
 	#define LOCK(_Lock)			(WAIT_OBJECT_0 == WaitForSingleObject(_Lock,INFINITE))
 	#define UNLOCK(_Lock)		ReleaseMutex(_Lock);
+	// condition emulated with a counting semaphore, waiters must re-check their predicate
+	#define INIT_COND(_Cond)	(((_Cond) = CreateSemaphore(NULL, 0, LONG_MAX, NULL)) == NULL)
+	#define WAIT_COND(_Cond, _Lock)	{ UNLOCK(_Lock); WaitForSingleObject(_Cond,INFINITE); LOCK(_Lock); }
+	#define TIMED_WAIT_COND(_Cond, _Lock, _Ms)	{ UNLOCK(_Lock); WaitForSingleObject(_Cond,(_Ms)); LOCK(_Lock); }
+	#define SIGNAL_COND(_Cond)		ReleaseSemaphore(_Cond, 1, NULL)
+	#define BROADCAST_COND(_Cond)	ReleaseSemaphore(_Cond, 1024, NULL)
 	#define SLEEP(_S)			Sleep(_S)
 	#define ASSERT				_ASSERTE
+	#define CAS_PTR(_P, _Old, _New)	(InterlockedCompareExchangePointer((PVOID volatile *)(_P), (_New), (_Old)) == (_Old))
+	#define XCHG_PTR(_P, _New)		InterlockedExchangePointer((PVOID volatile *)(_P), (_New))
+	#define THREAD_LOCAL			__declspec(thread)
 #else
 	#include <stdlib.h>
 	#include <stdarg.h>
@@ -36,17 +44,29 @@
 	#include <sys/time.h>
 	#include <event.h>
 	#include <stdlib.h>
-	#include "threadpool.h"
+	#include <time.h>
 
 	typedef pthread_mutex_t mutex_type;
+	typedef pthread_cond_t cond_type;
 	typedef uint32_t ul4;
 	typedef int sock;
 
 	#define INIT_LOCK(_Lock)	(pthread_mutex_init(&(_Lock), NULL) != 0)
 	#define LOCK(_Lock)			(0 == pthread_mutex_lock(&(_Lock)))
     #define UNLOCK(_Lock)		pthread_mutex_unlock(&(_Lock))
+	#define INIT_COND(_Cond)	(pthread_cond_init(&(_Cond), NULL) != 0)
+	#define WAIT_COND(_Cond, _Lock)	pthread_cond_wait(&(_Cond), &(_Lock))
+	#define TIMED_WAIT_COND(_Cond, _Lock, _Ms)	{ struct timespec _ts; clock_gettime(CLOCK_REALTIME, &_ts);\
+												  _ts.tv_sec += (_Ms) / 1000; _ts.tv_nsec += ((_Ms) % 1000) * 1000000L;\
+												  if (_ts.tv_nsec >= 1000000000L) { ++_ts.tv_sec; _ts.tv_nsec -= 1000000000L; }\
+												  pthread_cond_timedwait(&(_Cond), &(_Lock), &_ts); }
+	#define SIGNAL_COND(_Cond)		pthread_cond_signal(&(_Cond))
+	#define BROADCAST_COND(_Cond)	pthread_cond_broadcast(&(_Cond))
 	#define SLEEP(_S)			usleep(1000 * (_S))
 	#define ASSERT				assert
+	#define CAS_PTR(_P, _Old, _New)	__sync_bool_compare_and_swap((_P), (_Old), (_New))
+	#define XCHG_PTR(_P, _New)		__sync_lock_test_and_set((_P), (_New))
+	#define THREAD_LOCAL			__thread
 #endif
 
 #endif //_PLATFORM_H_
@@ -1,6 +1,12 @@
 #include "port.h"
+#include "marshal.h"
+#include "cmd_queue.h"
+#include "evloop.h"
 
 #include <stdio.h>
+#ifndef __WIN32__
+#include <errno.h>
+#endif
 
 port::port(void)
 {
@@ -13,10 +19,16 @@ port::port(void)
 	stdi = 0;
 	stdo = 1;
 #endif
+	rbuf.resize(READ_CHUNK_SIZE);
+	rpos = rend = 0;
     if (INIT_LOCK(port_r_lock))
         return;
+#ifdef __WIN32__
     if (INIT_LOCK(port_w_lock))
         return;
+    if (INIT_COND(port_w_cond))
+        return;
+#endif
 }
 
 bool port::lockr()
@@ -29,55 +41,69 @@ void port::unlockr()
 	UNLOCK(port_r_lock);
 }
 
-bool port::lockw()
-{
-	return LOCK(port_w_lock);
-}
-
-void port::unlockw()
-{
-	UNLOCK(port_w_lock);
-}
-
-int port::read_exact(vector<unsigned char> & buf, unsigned long len)
+int port::read_exact(vector<unsigned char> & buf, unsigned long got, unsigned long len)
 {
 	int i;
-	unsigned long got=0;
 
 	if (buf.size() < len)
 		buf.resize(len);
-	do {
+	while (got<len) {
 		if ((i = read(stdi, &buf[0]+got, len-got)) <= 0)
 			return(i);
 		got += i;
-	} while (got<len);
+	}
 	return(len);
 }
 
-int port::write_exact(vector<unsigned char> & buf)
+// at least want bytes buffered, reading as much as the chunk holds per syscall
+int port::fill(size_t want)
 {
-	int i, wrote = 0;
-
-	int len = (int)buf.size();
-	do {
-		if ((i = write(stdo, &buf[0]+wrote, len-wrote)) <= 0)
-			return (i);
-		wrote += i;
-	} while (wrote<len);
-
-	return (len);
+	if (rend - rpos >= want)
+		return 1;
+	if (rpos == rend) {
+		rpos = rend = 0;
+	} else if (rpos > 0) {
+		memmove(&rbuf[0], &rbuf[rpos], rend - rpos);
+		rend -= rpos;
+		rpos = 0;
+	}
+	while (rend < want) {
+		int i = read(stdi, &rbuf[rend], rbuf.size() - rend);
+		if (i <= 0)
+			return i;
+		rend += i;
+	}
+	return 1;
 }
 
+// frames already buffered are split off without a syscall, a frame larger
+// than the buffered bytes is read straight into buf
 int port::read_cmd(vector<unsigned char> & buf)
 {
 	int len = 0;
 	buf.clear();
 	if (lockr()) {
-		if(read_exact(buf, 4) < 0) {
+		if(fill(sizeof(ul4)) <= 0) {
 			unlockr();
 			return (-1);
 		}
-		len = read_exact(buf, ntohl(*((ul4*)&buf[0])));
+		ul4 flen;
+		memcpy(&flen, &rbuf[rpos], sizeof(ul4));
+		flen = ntohl(flen);
+		rpos += sizeof(ul4);
+
+		size_t have = rend - rpos;
+		if (have >= flen) {
+			buf.assign(rbuf.begin() + rpos, rbuf.begin() + rpos + flen);
+			rpos += flen;
+			len = flen;
+		} else {
+			buf.resize(flen);
+			if (have > 0)
+				memcpy(&buf[0], &rbuf[rpos], have);
+			rpos = rend = 0;
+			len = read_exact(buf, (unsigned long)have, flen);
+		}
 		unlockr();
 	}
 	return len;
@@ -85,15 +111,98 @@ int port::read_cmd(vector<unsigned char> & buf)
 
 int port::write_cmd(vector<unsigned char> & buf)
 {
-	vector<unsigned char> li(sizeof(ul4));
-	
-	ul4 len = htonl((ul4)buf.size());
-	memcpy(&li[0], &len, sizeof(ul4));
-
-	if(lockw()) {
-		write_exact(li);
-		len = write_exact(buf);
-		unlockw();
+	int len = (int)buf.size();
+	if (outq.push(buf, true)) {
+		// the writer only sleeps on an empty queue
+#ifdef __WIN32__
+		if (LOCK(port_w_lock)) {
+			SIGNAL_COND(port_w_cond);
+			UNLOCK(port_w_lock);
+		}
+#else
+		evloop::notify();
+#endif
 	}
 	return len;
 }
+
+#ifdef __WIN32__
+void port::write_loop(void)
+{
+	for(;;) {
+		if (!outq.take()) {
+			if (LOCK(port_w_lock)) {
+				while (!outq.take())
+					WAIT_COND(port_w_cond, port_w_lock);
+				UNLOCK(port_w_lock);
+			}
+		}
+		if (outq.flush(stdo) < 0) {
+			REMOTE_LOG(CRT, "response write failed, shutting down port\n");
+			exit(1);
+		}
+	}
+}
+
+DWORD WINAPI port::writer(LPVOID arg)
+{
+	((port *)arg)->write_loop();
+	return 0;
+}
+
+void port::start_writer(void)
+{
+	if (NULL == CreateThread(NULL, 0, writer, this, 0, NULL)) {
+		REMOTE_LOG(CRT, "CreateThread for writer failed. LastError: %u\n", GetLastError());
+		exit(0);
+	}
+}
+#else
+// one read per readiness, every complete frame is handed to cmd_queue,
+// -1 once stdin is closed
+int port::read_ready(void)
+{
+	if (rpos == rend) {
+		rpos = rend = 0;
+		if (rbuf.size() > READ_CHUNK_SIZE)
+			vector<unsigned char>(READ_CHUNK_SIZE).swap(rbuf);
+	} else if (rend == rbuf.size()) {
+		// a full buffer ending in a partial length header, a read of 0 bytes
+		// would be taken for the end of stdin
+		if (rpos > 0) {
+			memmove(&rbuf[0], &rbuf[rpos], rend - rpos);
+			rend -= rpos;
+			rpos = 0;
+		} else
+			rbuf.resize(rbuf.size() + READ_CHUNK_SIZE);
+	}
+
+	int i = read(stdi, &rbuf[rend], rbuf.size() - rend);
+	if (i < 0)
+		return ((errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1);
+	if (i == 0)
+		return -1;
+	rend += i;
+
+	while (rend - rpos >= sizeof(ul4)) {
+		ul4 flen;
+		memcpy(&flen, &rbuf[rpos], sizeof(ul4));
+		flen = ntohl(flen);
+		if (rend - rpos - sizeof(ul4) < flen) {
+			// the rest of a partial frame has to fit behind what is buffered
+			if (rpos > 0) {
+				memmove(&rbuf[0], &rbuf[rpos], rend - rpos);
+				rend -= rpos;
+				rpos = 0;
+			}
+			if (rbuf.size() < sizeof(ul4) + flen)
+				rbuf.resize(sizeof(ul4) + flen);
+			break;
+		}
+		vector<unsigned char> frame(rbuf.begin() + rpos + sizeof(ul4), rbuf.begin() + rpos + sizeof(ul4) + flen);
+		rpos += sizeof(ul4) + flen;
+		cmd_queue::push(frame);
+	}
+	return 0;
+}
+#endif
@@ -16,25 +16,35 @@
 #define PORT_H
 
 #include "platform.h"
+#include "out_queue.h"
 
 #include <iostream>
 #include <vector>
 
 using namespace std;
 
+#define READ_CHUNK_SIZE	0x00010000UL	// stdin bytes pulled per read
+
 class port
 {
 private:
 	int stdi;
 	int stdo;
 	mutex_type port_r_lock;
-	mutex_type port_w_lock;
+	vector<unsigned char> rbuf;	// frames read ahead from stdin, rpos to rend not yet consumed
+	size_t rpos;
+	size_t rend;
+	out_queue outq;				// encoded responses pushed by the workers
 	inline bool lockr();
 	inline void unlockr();
-	inline bool lockw();
-	inline void unlockw();
-	int read_exact(vector<unsigned char> &, unsigned long);
-	int write_exact(vector<unsigned char> &);
+	int fill(size_t);
+	int read_exact(vector<unsigned char> &, unsigned long, unsigned long);
+#ifdef __WIN32__
+	mutex_type port_w_lock;		// only guards the writer's sleep on an empty queue
+	cond_type port_w_cond;
+	void write_loop(void);
+	static DWORD WINAPI writer(LPVOID);
+#endif
 
 	port(void);
 	port(port const&);          // Not implemented
@@ -47,7 +57,17 @@ public:
 		return p;
 	}
 	int read_cmd(vector<unsigned char>&);
+	// queues the response for the writer, buf is taken over
 	int write_cmd(vector<unsigned char>&);
+#ifdef __WIN32__
+	void start_writer(void);
+#else
+	// event loop side, stdin and stdout are non blocking
+	inline int in_fd(void) { return stdi; };
+	inline int out_fd(void) { return stdo; };
+	int read_ready(void);
+	inline int flush(void) { outq.take(); return outq.flush(stdo); };
+#endif
 
 	inline ~port(void) {};
 };
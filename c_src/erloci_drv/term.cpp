@@ -1,6 +1,50 @@
 #include "platform.h"
 #include "term.h"
 
+// atoms of the responses, stored by reference
+static const char * const atoms[] = {
+	"ok", "error", "rows", "cols", "rowids", "executed", "cursor",
+	"desc", "lob", "stmt", "badarg", "timeout", "cancelled", "unknwon",
+	"true", "false", "undefined", "null", NULL
+};
+
+const char * term::intern(const char * a)
+{
+	for (const char * const * i = atoms; *i != NULL; ++i)
+		if (**i == *a && strcmp(*i, a) == 0)
+			return *i;
+	return NULL;
+}
+
+// len bytes and a NUL, inline if they fit
+char * term::str_buf(size_t len)
+{
+	str_len = len;
+	if (len < TERM_INLINE_STR) {
+		store = STR_INLINE;
+		sso[len] = '\0';
+		return sso;
+	}
+	store = STR_HEAP;
+	big.resize(len+1);
+	big[len] = '\0';
+	return &big[0];
+}
+
+void term::copy_str(const char * s, size_t len)
+{
+	if (len < TERM_INLINE_STR) {
+		store = STR_INLINE;
+		memcpy(sso, s, len);
+		sso[len] = '\0';
+	} else {
+		store = STR_HEAP;
+		big.reserve(len+1);
+		big.assign(s, s + len);
+		big.push_back('\0');
+	}
+}
+
 string term::print()
 {
 	string term;
@@ -27,12 +71,12 @@ string term::print()
 				term += "]";
 			} else {
 				term += "\"";
-				term += str;
+				term += str();
 				term += "\"";
 			}
 			break;
 		case ATOM:
-			term += str;
+			term += str();
 			break;
 		case FLOAT: {
 			stringstream ss;
@@ -68,7 +112,7 @@ string term::print()
 			term += "<<";
 			for(size_t idx = 0; idx < str_len; ++idx) {
 				stringstream ss;
-				ss << (unsigned int)str[idx];
+				ss << (unsigned int)(unsigned char)str()[idx];
 				term += ss.str();
 				if (idx+1 < str_len)
 						term += ",";
@@ -108,7 +152,10 @@ void term::set(Type t, char * s)
 	type = t;
 	if (s) {
 		str_len = strlen(s) + 1;
-		str.assign(s, s + str_len);
+		if (t == ATOM && NULL != (ext = intern(s)))
+			store = STR_EXTERN;
+		else
+			copy_str(s, str_len - 1);
 	}
 }
 
@@ -119,7 +166,7 @@ void term::set(Type t, char *ns, int n, int c)
 	v.ppr.c = c;
 	if (ns) {
 		str_len = strlen(ns) + 1;
-		str.assign(ns, ns + str_len);
+		copy_str(ns, str_len - 1);
 	}
 }
 
@@ -131,7 +178,7 @@ void term::set(Type t, char *ns, int n, int s, int c)
 	v.ppr.c = c;
 	if (ns) {
 		str_len = strlen(ns) + 1;
-		str.assign(ns, ns + str_len);
+		copy_str(ns, str_len - 1);
 	}
 }
 
@@ -143,19 +190,16 @@ void term::set(Type t, char *ns, unsigned int *n, int l, int c)
 	v.ppr.c = c;
 	if (ns) {
 		str_len = strlen(ns) + 1;
-		str.assign(ns, ns + str_len);
+		copy_str(ns, str_len - 1);
 	}
 }
 
 void term::set(Type t, unsigned char * s, int strl)
 {
 	type = t;
-	str_len = strl;
-	str.resize(str_len+1);
-	if (s && str_len > 0) {
-		str.assign(s, s+str_len+1);
-		str.push_back('\0');
-	}
+	char * b = str_buf(strl);
+	if (s && strl > 0)
+		memcpy(b, s, strl);
 }
 
 void term::set(Type t, double dbl)
@@ -191,5 +235,16 @@ void term::set(Type t, unsigned long long ull)
 void term::set(Type t, term & trm, unsigned long long idx)
 {
 	type = t;
-	lt.push_back(trm);
+	insert() = trm;
+}
+
+// children are swapped, not copied, into the larger storage
+void term::grow(size_t cap)
+{
+	term_list n;
+	n.reserve(cap);
+	n.resize(lt.size());
+	for (size_t i = 0; i < lt.size(); ++i)
+		n[i].swap(lt[i]);
+	lt.swap(n);
 }
@@ -17,21 +17,39 @@
 
 #include <iostream>
 #include <string>
-#include <list>
 #include <vector>
 #include <sstream>
+#include <algorithm>
 
 using namespace std;
 
 #include "erl_interface.h"
 #include "ei.h"
 
+#include "arena.h"
+
+#define TERM_MIN_CHILDREN	4	// first allocation of a list or tuple
+#define TERM_INLINE_STR		24	// payloads shorter than this are kept in the term
+
+// children and payload come from the arena of the worker running the command
 class term {
 private:
-	list<term> lt; // list or tuple
+	typedef vector<term, arena_alloc<term> > term_list;
+	term_list lt; // list or tuple, contiguous for O(1) indexing
+	void grow(size_t);
+
+	// where str() is, atoms of the driver are interned and binary views
+	// into a request are not copied
+	enum Store { STR_NONE, STR_INLINE, STR_EXTERN, STR_HEAP };
+	unsigned char store;
+	char sso[TERM_INLINE_STR];
+	const char * ext;
+	vector<char, arena_alloc<char> > big;
+	static const char * intern(const char *);
+	void copy_str(const char *, size_t);
 
 public:
-	typedef list<term>::iterator iterator;
+	typedef term_list::iterator iterator;
 	enum Type {
 		UNDEF		= ERL_UNDEF,
 		ATOM		= ERL_ATOM,
@@ -49,7 +67,6 @@ public:
 	};
 	Type type;
 
-	vector<char> str;
 	size_t str_len;
 	union {
 		int	i;
@@ -60,14 +77,28 @@ public:
 		unsigned long ul;
 		unsigned long long ull;
 		struct {
-			unsigned int nr[3];
+			unsigned int nr[5];
 			int n;
 			int s;
 			int c;
 		} ppr; // pid, port, ref, string or binary
 	} v;
 
-	inline term()	{ str_len = 0; type = UNDEF; };
+	inline term()	{ str_len = 0; type = UNDEF; store = STR_NONE; };
+
+	// atom name, binary payload or node name, NUL terminated unless the
+	// binary is a view, use str_len
+	inline const char * str() const
+	{
+		switch (store) {
+			case STR_INLINE:	return sso;
+			case STR_EXTERN:	return ext;
+			case STR_HEAP:		return &big[0];
+			default:			return "";
+		}
+	}
+	// writable storage for a payload of len bytes, str_len is set to len
+	char * str_buf(size_t len);
 
 	inline bool is_undef()		{ return type == UNDEF;			}
 	inline bool is_atom()		{ return type == ATOM;			}
@@ -116,46 +147,68 @@ public:
 	inline term & dbl(float f)						{ v.d = f;		type = FLOAT;		return *this;	};
 	inline term & dbl(double d)						{ v.d = d;		type = FLOAT;		return *this;	};
 
-	inline term & add(const term & t)				{ lt.push_back(t);					return *this;	};
-	inline term & add(int i)						{ lt.push_back(term().integer(i));	return *this;	};
-	inline term & add(long i)						{ lt.push_back(term().integer(i));	return *this;	};
-	inline term & add(long long i)					{ lt.push_back(term().integer(i));	return *this;	};
-	inline term & add(unsigned int i)				{ lt.push_back(term().integer(i));	return *this;	};
-	inline term & add(unsigned long i)				{ lt.push_back(term().integer(i));	return *this;	};
-	inline term & add(unsigned long long i)			{ lt.push_back(term().integer(i));	return *this;	};
-	inline term & add(float i)						{ lt.push_back(term().dbl(i));		return *this;	};
-	inline term & add(double i)						{ lt.push_back(term().dbl(i));		return *this;	};
+	inline term & add(const term & t)				{ insert() = t;				return *this;	};
+	inline term & add(int i)						{ insert().integer(i);		return *this;	};
+	inline term & add(long i)						{ insert().integer(i);		return *this;	};
+	inline term & add(long long i)					{ insert().integer(i);		return *this;	};
+	inline term & add(unsigned int i)				{ insert().integer(i);		return *this;	};
+	inline term & add(unsigned long i)				{ insert().integer(i);		return *this;	};
+	inline term & add(unsigned long long i)			{ insert().integer(i);		return *this;	};
+	inline term & add(float i)						{ insert().dbl(i);			return *this;	};
+	inline term & add(double i)						{ insert().dbl(i);			return *this;	};
+	// appends t without copying its payload or children, t is left undefined
+	inline term & take(term & t)					{ insert().swap(t);			return *this;	};
 
+	// a reference to a child is only valid until the next insert into its parent
 	inline term & insert()
 	{
+		if (lt.size() == lt.capacity())
+			grow(lt.empty() ? TERM_MIN_CHILDREN : lt.size() * 2);
 		lt.resize(lt.size()+1);
 		return lt.back();
 	}
+	inline void reserve(size_t n)	{ if (n > lt.capacity()) grow(n); }
+
+	inline void swap(term & t)
+	{
+		lt.swap(t.lt);
+		big.swap(t.big);
+		std::swap_ranges(sso, sso + TERM_INLINE_STR, t.sso);
+		std::swap(ext, t.ext);
+		std::swap(store, t.store);
+		std::swap(type, t.type);
+		std::swap(str_len, t.str_len);
+		std::swap(v, t.v);
+	}
 
 	inline term & atom(const char *_str)
 	{
 		type = ATOM;
 		str_len = strlen(_str)+1;
-		str.resize(str_len);
-		str.assign(_str, _str + str_len);
+		if (NULL != (ext = intern(_str)))
+			store = STR_EXTERN;
+		else
+			copy_str(_str, str_len-1);
 		return *this;
 	};
 
 	inline term & binary(const char *_str)
+	{
+		return binary(_str, strlen(_str));
+	};
+	inline term & binary(const char *_str, size_t len)
 	{
 		type = BINARY;
-		str_len = strlen(_str);
-		str.resize(str_len+1);
-		str.assign(_str, _str+str_len+1);
-		str.push_back('\0');
+		copy_str(_str, len);
+		str_len = len;
 		return *this;
 	};
-	inline term & binary(const char *_str, size_t len)
+	// refers to the bytes, which must outlive the term
+	inline term & binary_view(const char *_str, size_t len)
 	{
 		type = BINARY;
-		str.resize(len+1);
-		str.assign(_str, _str + len + 1);
-		str.push_back('\0');
+		ext = _str;
+		store = STR_EXTERN;
 		str_len = len;
 		return *this;
 	};
@@ -176,7 +229,7 @@ public:
 		v.ppr.s = s;
 		v.ppr.c = c;
 		str_len = strlen(_str)+1;
-		str.assign(_str, _str + str_len);
+		copy_str(_str, str_len-1);
 		return *this;
 	};
 	inline term & ref(char *_str, int n, int c)
@@ -185,7 +238,7 @@ public:
 		v.ppr.n = n;
 		v.ppr.c = c;
 		str_len = strlen(_str)+1;
-		str.assign(_str, _str + str_len);
+		copy_str(_str, str_len-1);
 		return *this;
 	};
 	inline term & port(char *_str, int n, int c)
@@ -194,19 +247,15 @@ public:
 		v.ppr.n = n;
 		v.ppr.c = c;
 		str_len = strlen(_str)+1;
-		str.assign(_str, _str + str_len);
+		copy_str(_str, str_len-1);
 		return *this;
 	};
 
-	term & operator[] (size_t x)
+	inline term & operator[] (size_t x)
 	{
-		int _x = (int)x;
-		if(_x<0)
+		if(x >= lt.size())
 			throw("index out of bounds");
-		for (iterator it = lt.begin(); it != lt.end(); ++it)
-			if(--_x < 0)
-				return (*it);
-		throw("index out of bounds");
+		return lt[x];
     }
 	inline iterator begin()		{ return lt.begin();	}
 	inline iterator end()		{ return lt.end();		}
@@ -18,232 +18,175 @@
 #include "marshal.h"
 #include "command.h"
 
+#include "cmd_queue.h"
+#include "term.h"
+#include "arena.h"
+
 bool threads::run_threads = true;
 transcoder & threads::tc = transcoder::instance();
 
-
-#ifdef __WIN32__
-	PTP_POOL threads::pool							= NULL;
-	TP_CALLBACK_ENVIRON threads::CallBackEnviron;
-	PTP_CLEANUP_GROUP threads::cleanupgroup			= NULL;
-	UINT threads::rollback							= 0;
-#else
-	threadpool_t * threads::pTp						= NULL;
-#endif
-
-#define THREAD          10
-#define QUEUE           256
+unsigned int threads::workers		= 0;
+unsigned int threads::max_workers	= 0;
+unsigned int threads::ctl_workers	= 2;
+unsigned int threads::live			= 0;
+unsigned int threads::peak			= 0;
+unsigned long long threads::failed	= 0;
+mutex_type threads::t_lock;
 
 threads::threads(void)
 {
-    REMOTE_LOG(DBG, "Initializing Thread pool...");
+    REMOTE_LOG(DBG, "Initializing workers...");
 
 	command::config(marshall_intf_funs);
-
-#ifdef USING_THREAD_POOL
-#ifdef __WIN32__
-    InitializeThreadpoolEnvironment(&CallBackEnviron);
-
-    if (NULL == (pool = CreateThreadpool(NULL))) {
-	    REMOTE_LOG(CRT, "CreateThreadpool failed. LastError: %u", GetLastError());
-        goto main_cleanup;
-    }
-    rollback = 1; // pool creation succeeded
-
-    SetThreadpoolThreadMaximum(pool, THREAD);
-
-    if (FALSE == SetThreadpoolThreadMinimum(pool, 1)) {
-	    REMOTE_LOG(CRT, "SetThreadpoolThreadMinimum failed. LastError: %u", GetLastError());
-        goto main_cleanup;
-    }
-
-    if (NULL == (cleanupgroup = CreateThreadpoolCleanupGroup())) {
-	    REMOTE_LOG(CRT, "CreateThreadpoolCleanupGroup failed. LastError: %u", GetLastError());
-        goto main_cleanup;
-    }
-    rollback = 2;  // Cleanup group creation succeeded
-
-	SetThreadpoolCallbackPool(&CallBackEnviron, pool);
-    SetThreadpoolCallbackCleanupGroup(&CallBackEnviron, cleanupgroup, NULL);
-	return;
-
-main_cleanup:
-    CloseThreadpool(pool);
-    pool = NULL;
-#else
-    pTp = threadpool_create(THREAD, QUEUE, 0);
-    if(NULL != pTp)
-        return;
-#endif
-    exit(0);
-#else
-#endif
+	if (INIT_LOCK(t_lock))
+		exit(0);
 }
 
-threads::~threads(void)
+void threads::config(unsigned int _workers, unsigned int _max_workers, unsigned int _ctl_workers)
 {
-    REMOTE_LOG(DBG, "Cleanup Thread pool...");
+	workers = _workers;
+	max_workers = _max_workers;
+	ctl_workers = _ctl_workers;
+}
 
-#ifdef USING_THREAD_POOL
+static unsigned int cpu_count(void)
+{
 #ifdef __WIN32__
-    BOOL bRet = FALSE;
-
-    // Wait for all callbacks to finish.
-    CloseThreadpoolCleanupGroupMembers(cleanupgroup, TRUE, NULL);
-    rollback = 2;
-    goto main_cleanup;
-
-main_cleanup:
-    switch (rollback) {
-    case 3:
-        // Clean up the cleanup group members.
-        CloseThreadpoolCleanupGroupMembers(cleanupgroup,FALSE,NULL);
-    case 2:
-        // Clean up the cleanup group.
-        CloseThreadpoolCleanupGroup(cleanupgroup);
-    case 1:
-        // Clean up the pool.
-        CloseThreadpool(pool);
-
-    default:
-        break;
-    }
-#else
-    if(pTp)
-        threadpool_destroy(pTp, 0);
-#endif
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	long n = (long)si.dwNumberOfProcessors;
 #else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
 #endif
+	return (n > 0 ? (unsigned int)n : 1);
 }
 
-#include "cmd_queue.h"
-#include "term.h"
-
-//
-// This is the thread pool work callback function.
-//
-static
-#ifdef USING_THREAD_POOL
 #ifdef __WIN32__
-	VOID CALLBACK
+DWORD WINAPI threads::worker(LPVOID arg)
 #else
-	void
+void * threads::worker(void * arg)
 #endif
-#else
-	DWORD WINAPI
-#endif
-ProcessCommandCb (
-#ifdef USING_THREAD_POOL
-#ifdef __WIN32__
-    PTP_CALLBACK_INSTANCE Instance,
-    PVOID                 arg,
-    PTP_WORK              Work
-#else
-    void *arg
-#endif
-#else
-	LPVOID arg
-#endif
-)
 {
-    //REMOTE_LOG(DBG, "Port: WorkThread processing command...\n");
-#ifdef USING_THREAD_POOL
-#ifdef __WIN32__
-    // Instance, Parameter, and Work not used in this example.
-    UNREFERENCED_PARAMETER(Instance);
-    UNREFERENCED_PARAMETER(arg);
-    UNREFERENCED_PARAMETER(Work);
-#endif
-#else
-    UNREFERENCED_PARAMETER(arg);
-#endif
+	WORKER_KIND kind = (WORKER_KIND)(size_t)arg;
 
+	// Long running worker, sleeps in cmd_queue::pop() until a command
+	// arrives or the queue is closed on shutdown, extra workers also
+	// leave once they idled for WORKER_IDLE_MS
 	vector<unsigned char> rxpkt;
-#ifdef __WIN32__
-	DWORD start, end;	
-#endif
-	while (threads::run_threads) {
-		rxpkt = cmd_queue::pop();
-		if (rxpkt.size() > 0)
-			break;
-#ifdef __WIN32__
-		start = GetTickCount();
-		if(!SwitchToThread())
-			Sleep(50);
-		end = GetTickCount();
-		if (end - start < 50) {
-			rxpkt = cmd_queue::pop();
-			if (rxpkt.size() > 0)
-				break;
-			Sleep(end - start);
+	unsigned long long sess, deadline;
+	arena mem;
+	arena::attach(&mem);
+	while (threads::run_threads
+		   && cmd_queue::pop(rxpkt, sess, deadline, kind == WORKER_CONTROL, (kind == WORKER_EXTRA ? WORKER_IDLE_MS : 0))) {
+		bool parked = false;
+		{
+			// request and response terms are gone once the response is written,
+			// binaries of the request are views into rxpkt
+			term t;
+			threads::tc.decode(rxpkt, t, true);
+			if(command::process(t, deadline, parked))
+				exit(1);
 		}
-#else
-#ifdef __APPLE__
-        pthread_yield_np();
-#else
-		pthread_yield();
-#endif
-		usleep(50000);
-#endif
+		mem.reset();
+		if (parked)
+			// the session stays busy until the call completes
+			cmd_queue::park(rxpkt, sess, deadline);
+		else
+			// releases the next command of the session
+			cmd_queue::done(sess);
 	}
-	if(!threads::run_threads)
-#ifdef USING_THREAD_POOL
-		return;
-#else
-		return 0;
-#endif
-#ifdef USING_THREAD_POOL
-	threads::start();
-#endif
+	arena::attach(NULL);
+	worker_exit(kind);
 
-	term t;
-	threads::tc.decode(rxpkt, t);
-	if(command::process(t))
-		exit(1);
-
-#ifdef USING_THREAD_POOL
-	return;
+#ifdef __WIN32__
+	return 0;
 #else
-    return 0;
+	return NULL;
 #endif
 }
 
+void threads::worker_exit(WORKER_KIND kind)
+{
+	if (kind != WORKER_CONTROL && LOCK(t_lock)) {
+		--live;
+		UNLOCK(t_lock);
+	}
+}
+
 void threads::start(void)
 {
-    //REMOTE_LOG(DBG, "Port: Delegating command processing to WorkThread...");
-#ifdef USING_THREAD_POOL
-	#ifdef __WIN32__
-		PTP_WORK work = NULL;
-		work = CreateThreadpoolWork(ProcessCommandCb, NULL, &CallBackEnviron);
-
-		if (NULL == work) {
-			REMOTE_LOG(CRT, "CreateThreadpoolWork failed. LastError: %u\n", GetLastError());
+	if (workers == 0)
+		workers = cpu_count();
+	if (max_workers == 0)
+		max_workers = 4 * workers;
+	if (max_workers < workers)
+		max_workers = workers;
+	REMOTE_LOG(INF, "%u workers, up to %u under load, %u reserved for control commands\n", workers, max_workers, ctl_workers);
+
+	for (unsigned int i = 0; i < workers; ++i)
+		if (!start_worker(WORKER_BASE)) {
+			REMOTE_LOG(CRT, "could not start worker %u of %u\n", i + 1, workers);
+			exit(0);
+		}
+	for (unsigned int i = 0; i < ctl_workers; ++i)
+		if (!start_worker(WORKER_CONTROL)) {
+			REMOTE_LOG(CRT, "could not start control worker %u of %u\n", i + 1, ctl_workers);
 			exit(0);
 		}
+}
 
-		rollback = 3;  // Creation of work succeeded
+// Workers block in OCI for as long as a query runs, commands queued behind
+// them get one more worker each until max_workers are running
+void threads::grow(void)
+{
+	if (cmd_queue::starved() && !start_worker(WORKER_EXTRA))
+		REMOTE_LOG(ERR, "could not start extra worker, %u running\n", live);
+}
 
-		//
-		// Submit the work to the pool. Because this was a pre-allocated
-		// work item (using CreateThreadpoolWork), it is guaranteed to execute.
-		//
-		SubmitThreadpoolWork(work);
-	#else
-		threadpool_add(pTp, &ProcessCommandCb, NULL, 0);
-	#endif
-#else
-	#ifdef __WIN32__
-	if (NULL == CreateThread( 
-            NULL,                   // default security attributes
-            0,                      // use default stack size  
-            ProcessCommandCb,       // thread function name
-            NULL,					// argument to thread function 
-            0,                      // use default creation flags 
-            NULL)) {
-		REMOTE_LOG(CRT, "CreateThreadpoolWork failed. LastError: %u\n", GetLastError());
-		exit(0);
+// false if the thread could not be created, extra workers beyond
+// max_workers are not started
+bool threads::start_worker(WORKER_KIND kind)
+{
+	if (kind != WORKER_CONTROL && LOCK(t_lock)) {
+		if (kind == WORKER_EXTRA && live >= max_workers) {
+			UNLOCK(t_lock);
+			return true;
+		}
+		++live;
+		if (live > peak)
+			peak = live;
+		UNLOCK(t_lock);
 	}
-	#else
-	#endif
+
+	void * arg = (void *)(size_t)kind;
+	bool ok;
+#ifdef __WIN32__
+	HANDLE h = CreateThread(NULL, 0, worker, arg, 0, NULL);
+	ok = (h != NULL);
+	if (ok)
+		CloseHandle(h);
+#else
+	pthread_t tid;
+	ok = (pthread_create(&tid, NULL, worker, arg) == 0);
+	if (ok)
+		pthread_detach(tid);
 #endif
+
+	if (!ok && LOCK(t_lock)) {
+		if (kind != WORKER_CONTROL)
+			--live;
+		++failed;
+		UNLOCK(t_lock);
+	}
+	return ok;
+}
+
+void threads::stats(unsigned int & _live, unsigned int & _peak, unsigned long long & _failed)
+{
+	if (LOCK(t_lock)) {
+		_live = live;
+		_peak = peak;
+		_failed = failed;
+		UNLOCK(t_lock);
+	}
 }
@@ -17,6 +17,14 @@
 
 #include "transcoder.h"
 
+#define WORKER_IDLE_MS	30000	// extra workers exit after idling this long
+
+typedef enum _WORKER_KIND {
+	WORKER_BASE		= 0,	// started with the port, lives as long as it
+	WORKER_CONTROL	= 1,	// reserved for LANE_CTL commands
+	WORKER_EXTRA	= 2		// started by grow() while the others block in OCI
+} WORKER_KIND;
+
 class threads {
 public:
 	static bool run_threads;
@@ -28,17 +36,30 @@ public:
 		start();
 		return t;
 	}
+	// starts the long running workers, called once
 	static void start(void);
-	~threads(void);
+	// set before init, workers 0 means one per CPU, max_workers 0 four times that
+	static void config(unsigned int workers, unsigned int max_workers, unsigned int ctl_workers);
+	// starts one more general worker if ready commands find none idle
+	static void grow(void);
+	static void stats(unsigned int & live, unsigned int & peak, unsigned long long & failed);
+	~threads(void) {};
 
 private:
+	static unsigned int workers;
+	static unsigned int max_workers;
+	static unsigned int ctl_workers;
+	static unsigned int live;		// general workers, base and extra
+	static unsigned int peak;
+	static unsigned long long failed;	// workers that could not be started
+	static mutex_type t_lock;
+
+	static bool start_worker(WORKER_KIND);
+	static void worker_exit(WORKER_KIND);
 #ifdef __WIN32__
-	static PTP_POOL pool;
-	static TP_CALLBACK_ENVIRON CallBackEnviron;
-	static PTP_CLEANUP_GROUP cleanupgroup;
-	static UINT rollback;
+	static DWORD WINAPI worker(LPVOID);
 #else
-	static threadpool_t *pTp;
+	static void * worker(void *);
 #endif
 
 	threads(void);
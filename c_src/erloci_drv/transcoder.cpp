@@ -1,201 +1,298 @@
 #include "platform.h"
 #include "transcoder.h"
+#include "marshal.h"
+
+#include <limits.h>
 
 using namespace std;
 
+#define NR_MAX	(sizeof(((term*)0)->v.ppr.nr)/sizeof(((term*)0)->v.ppr.nr[0]))
+
+/*
+ * Terms are converted with the reentrant ei_decode_* / ei_encode_* API,
+ * unlike the ETERM allocator of erl_interface it keeps no global state
+ * so any number of worker threads can transcode at the same time.
+ */
 transcoder::transcoder(void)
 {
-	erl_init(NULL, 0);
-    if (INIT_LOCK(transcoder_lock)) {
-        return;
-    }
+	ei_init();
 }
 
-bool transcoder::lock()
+void transcoder::decode(vector<unsigned char> & buf, term & t, bool view)
 {
-	return LOCK(transcoder_lock);
-}
+	int idx = 0, version = 0;
+	const char * b = (const char *)&buf[0];
 
-void transcoder::unlock()
-{
-	UNLOCK(transcoder_lock);
+	if (buf.size() == 0 || ei_decode_version(b, &idx, &version) < 0 || !decode(b, &idx, t, view)) {
+		REMOTE_LOG(ERR, "malformed term of %u bytes\n", buf.size());
+		t = term();
+	}
 }
 
-void transcoder::decode(vector<unsigned char> & buf, term & t)
+bool transcoder::decode(const char * buf, int * idx, term & t, bool view)
 {
-	unsigned long allocated, freed;
-	if(lock()) {
-		ETERM * etermp = erl_decode(&buf[0]);
-
-		erlterm_to_stl(etermp, t);
-
-		// If allocated != 0 after freeing the term
-		// we have a memory leak
-		// release the mutex in either case
-		erl_free_compound(etermp);
-		stats(allocated, freed);
-		if (allocated != 0) {
-			unlock();
+	int type = 0, size = 0;
+	if (ei_get_type(buf, idx, &type, &size) < 0)
+		return false;
+
+	switch (type) {
+		case ERL_ATOM_EXT:
+		case ERL_SMALL_ATOM_EXT:
+		case ERL_ATOM_UTF8_EXT:
+		case ERL_SMALL_ATOM_UTF8_EXT: {
+			char atom[MAXATOMLEN_UTF8];
+			if (ei_decode_atom(buf, idx, atom) < 0)
+				return false;
+			t.set(term::ATOM, atom);
+			break;
+		}
+		case ERL_FLOAT_EXT:
+		case NEW_FLOAT_EXT: {
+			double d = 0;
+			if (ei_decode_double(buf, idx, &d) < 0)
+				return false;
+			t.set(term::FLOAT, d);
+			break;
+		}
+		case ERL_PID_EXT:
+		case ERL_NEW_PID_EXT: {
+			erlang_pid pid;
+			if (ei_decode_pid(buf, idx, &pid) < 0)
+				return false;
+			t.set(term::PID, pid.node, (int)pid.num, (int)pid.serial, (int)pid.creation);
+			break;
+		}
+		case ERL_PORT_EXT:
+		case ERL_NEW_PORT_EXT: {
+			erlang_port port;
+			if (ei_decode_port(buf, idx, &port) < 0)
+				return false;
+			t.set(term::PORT, port.node, (int)port.id, (int)port.creation);
+			break;
+		}
+		case ERL_REFERENCE_EXT:
+		case ERL_NEW_REFERENCE_EXT:
+		case ERL_NEWER_REFERENCE_EXT: {
+			erlang_ref ref;
+			if (ei_decode_ref(buf, idx, &ref) < 0)
+				return false;
+			int len = ref.len;
+			if ((size_t)len > NR_MAX)
+				len = (int)NR_MAX;
+			t.set(term::REF, ref.node, ref.n, len, (int)ref.creation);
+			t.v.ppr.n = len;
+			break;
+		}
+		case ERL_BINARY_EXT: {
+			if (view) {
+				// tag and 4 byte length ahead of the bytes
+				t.binary_view(buf + *idx + 5, (size_t)size);
+				*idx += 5 + size;
+				break;
+			}
+			long len = 0;
+			t.type = term::BINARY;
+			char * b = t.str_buf(size);
+			if (ei_decode_binary(buf, idx, b, &len) < 0)
+				return false;
+			b[len] = '\0';
+			t.str_len = (size_t)len;
+			break;
+		}
+		case ERL_SMALL_INTEGER_EXT:
+		case ERL_INTEGER_EXT:
+		case ERL_SMALL_BIG_EXT:
+		case ERL_LARGE_BIG_EXT: {
+			long long ll = 0;
+			unsigned long long ull = 0;
+			if (ei_decode_longlong(buf, idx, &ll) == 0) {
+				if (ll >= INT_MIN && ll <= INT_MAX)
+					t.set(term::INTEGER, (int)ll);
+				else if (ll > 0 && ll <= UINT_MAX)
+					t.set(term::U_INTEGER, (unsigned int)ll);
+				else
+					t.set(term::LONGLONG, ll);
+			} else if (ei_decode_ulonglong(buf, idx, &ull) == 0) {
+				t.set(term::U_LONGLONG, ull);
+			} else
+				return false;
+			break;
+		}
+		case ERL_NIL_EXT:
+			if (ei_decode_list_header(buf, idx, &size) < 0)
+				return false;
+			t.lst();
+			break;
+		case ERL_STRING_EXT: {
+			// list of small integers packed as bytes
+			string s(size, '\0');
+			if (ei_decode_string(buf, idx, size > 0 ? &s[0] : NULL) < 0)
+				return false;
+			t.lst();
+			t.reserve(size);
+			for (int i = 0; i < size; ++i)
+				t.insert().set(term::INTEGER, (int)(unsigned char)s[i]);
+			break;
 		}
-		unlock();
+		case ERL_LIST_EXT: {
+			if (ei_decode_list_header(buf, idx, &size) < 0)
+				return false;
+			if (t.is_undef())
+				t.lst();
+			t.reserve(size);
+			for (int i = 0; i < size; ++i)
+				if (!decode(buf, idx, t.insert(), view))
+					return false;
+			// proper list tail
+			if (ei_decode_list_header(buf, idx, &size) < 0 || size != 0)
+				return false;
+			break;
+		}
+		case ERL_SMALL_TUPLE_EXT:
+		case ERL_LARGE_TUPLE_EXT: {
+			if (ei_decode_tuple_header(buf, idx, &size) < 0)
+				return false;
+			if (t.is_undef())
+				t.tuple();
+			t.reserve(size);
+			for (int i = 0; i < size; ++i)
+				if (!decode(buf, idx, t.insert(), view))
+					return false;
+			break;
+		}
+		default:
+			return false;
 	}
+	return true;
 }
 
 vector<unsigned char> transcoder::encode_with_header(term & t)
 {
-	unsigned long allocated, freed;
-	vector<unsigned char> buf;
-	if(lock()) {
-		ETERM * etermp = stl_to_erlterm(t);
-
-		// If allocated != 0 after freeing the term
-		// we have a memory leak
-		// release the mutex in either case
-		unsigned long len = (unsigned long)erl_term_len(etermp);
-
-		// Header(32bit) : term length in network byte order
-		buf.resize(len+4);
-		len = htonl(len);
-		buf[3] = (unsigned char) ((len >> 24)	& 0x000000FF);
-		buf[2] = (unsigned char) ((len >> 16)	& 0x000000FF);
-		buf[1] = (unsigned char) ((len >> 8)	& 0x000000FF);
-		buf[0] = (unsigned char) (len			& 0x000000FF);
-
-		erl_encode(etermp, &buf[4]);
-		erl_free_compound(etermp);
-		stats(allocated, freed);
-		if (allocated != 0) {
-			unlock();
-			return buf;
-		}
-		unlock();
-	}
+	// first pass only computes the size
+	int len = 1;
+	encode(NULL, &len, t);
+
+	// Header(32bit) : term length in network byte order
+	vector<unsigned char> buf(len+4);
+	buf[0] = (unsigned char) ((len >> 24)	& 0x000000FF);
+	buf[1] = (unsigned char) ((len >> 16)	& 0x000000FF);
+	buf[2] = (unsigned char) ((len >> 8)	& 0x000000FF);
+	buf[3] = (unsigned char) (len			& 0x000000FF);
+
+	int idx = 0;
+	ei_encode_version((char*)&buf[4], &idx);
+	encode((char*)&buf[4], &idx, t);
+
 	return buf;
 }
 
 vector<unsigned char> transcoder::encode(term & t)
 {
-	unsigned long allocated, freed;
-	vector<unsigned char> buf;
-	if(lock()) {
-		ETERM * etermp = stl_to_erlterm(t);
-		ASSERT(etermp != NULL);
-
-		// If allocated != 0 after freeing the term
-		// we have a memory leak
-		// release the mutex in either case
-		unsigned long len = (unsigned long)erl_term_len(etermp);
-		buf.resize(len);
-
-		erl_encode(etermp, &buf[0]);
-		erl_free_compound(etermp);
-		stats(allocated, freed);
-		if (allocated != 0) {
-			unlock();
-			return buf;
-		}
-		unlock();
-	}
+	// first pass only computes the size
+	int len = 1;
+	encode(NULL, &len, t);
+
+	vector<unsigned char> buf(len);
+
+	int idx = 0;
+	ei_encode_version((char*)&buf[0], &idx);
+	encode((char*)&buf[0], &idx, t);
+	ASSERT(idx == len);
+
 	return buf;
 }
 
-void transcoder::erlterm_to_stl(ETERM *et, term & t)
+// bytes t takes in a response (without version)
+size_t transcoder::encoded_size(term & t)
 {
-	if(0);
-	else if(ERL_IS_ATOM(et))				t.set(term::ATOM,		ERL_ATOM_PTR_UTF8(et));
-	else if(ERL_IS_FLOAT(et))				t.set(term::FLOAT,		ERL_FLOAT_VALUE(et));
-	else if(ERL_IS_PID(et))					t.set(term::PID,		ERL_PID_NODE_UTF8(et),	ERL_PID_NUMBER(et),		ERL_PID_SERIAL(et),		ERL_PID_CREATION(et));
-	else if(ERL_IS_PORT(et))				t.set(term::PORT,		ERL_PORT_NODE_UTF8(et),	ERL_PORT_NUMBER(et),	ERL_PORT_CREATION(et));
-	else if(ERL_IS_REF(et))					t.set(term::REF,		ERL_REF_NODE_UTF8(et),	ERL_REF_NUMBERS(et),	ERL_REF_LEN(et),		ERL_REF_CREATION(et));
-	else if(ERL_IS_BINARY(et))				t.set(term::BINARY,		ERL_BIN_PTR(et),		ERL_BIN_SIZE(et));
-	else if(ERL_IS_INTEGER(et))				t.set(term::INTEGER,	ERL_INT_VALUE(et));
-	else if(ERL_IS_UNSIGNED_INTEGER(et))	t.set(term::U_INTEGER,	ERL_INT_UVALUE(et));
-	else if(ERL_IS_LONGLONG(et))			t.set(term::LONGLONG,	ERL_LL_VALUE(et));
-	else if(ERL_IS_UNSIGNED_LONGLONG(et))	t.set(term::U_LONGLONG,	ERL_LL_UVALUE(et));
-	else if(ERL_IS_EMPTY_LIST(et))			t.set(term::LIST,		NULL, 0);
-	else if(ERL_IS_CONS(et) || ERL_IS_LIST(et)) {
-		ETERM *erl_list = et;
-		unsigned long long list_idx = 0;
-		if (t.is_undef())
-			t.lst();
-		do {
-			ETERM *et1 = ERL_CONS_HEAD(erl_list);
-			term & t1 = t.insert();
-			erlterm_to_stl(et1, t1);
-			//t.set(term::LIST, t1, list_idx);
-			erl_list = ERL_CONS_TAIL(erl_list);
-			++list_idx;
-		} while(erl_list && !ERL_IS_EMPTY_LIST(erl_list));
-	}
-	else if(ERL_IS_TUPLE(et)) {
-		if (t.is_undef())
-			t.tuple();
-		for(unsigned long long tuple_idx = 0; tuple_idx < (unsigned long long)ERL_TUPLE_SIZE(et); ++tuple_idx) {
-			term & t1 = t.insert();
-			erlterm_to_stl(ERL_TUPLE_ELEMENT(et, tuple_idx), t1);
-			//t.set(term::TUPLE, t1, tuple_idx);
-		}
-	}
+	int len = 0;
+	encode(NULL, &len, t);
+	return (size_t)len;
 }
 
-ETERM * transcoder::stl_to_erlterm(term & t)
+// encodes t (without version) at the end of buf
+void transcoder::append(term & t, vector<unsigned char> & buf)
+{
+	int len = 0;
+	encode(NULL, &len, t);
+
+	size_t pos = buf.size();
+	buf.resize(pos + len);
+
+	int idx = 0;
+	encode((char*)&buf[pos], &idx, t);
+}
+
+void transcoder::encode(char * buf, int * idx, term & t)
 {
-	ETERM * et = NULL;
 	switch (t.type) {
 		case term::ATOM:
-			et = erl_mk_atom(&t.str[0]);
+			ei_encode_atom(buf, idx, t.str());
 			break;
 		case term::FLOAT:
-			et = erl_mk_float(t.v.d);
+			ei_encode_double(buf, idx, t.v.d);
 			break;
-		case term::PID:
-			et = erl_mk_pid(&t.str[0], t.v.ppr.n, t.v.ppr.s, t.v.ppr.c);
+		case term::PID: {
+			erlang_pid pid;
+			strncpy(pid.node, t.str(), sizeof(pid.node)-1);
+			pid.node[sizeof(pid.node)-1] = '\0';
+			pid.num = t.v.ppr.n;
+			pid.serial = t.v.ppr.s;
+			pid.creation = t.v.ppr.c;
+			ei_encode_pid(buf, idx, &pid);
 			break;
-		case term::PORT:
-			et = erl_mk_port(&t.str[0], t.v.ppr.n, t.v.ppr.c);
+		}
+		case term::PORT: {
+			erlang_port port;
+			strncpy(port.node, t.str(), sizeof(port.node)-1);
+			port.node[sizeof(port.node)-1] = '\0';
+			port.id = t.v.ppr.n;
+			port.creation = t.v.ppr.c;
+			ei_encode_port(buf, idx, &port);
 			break;
-		case term::REF:
-			et = erl_mk_long_ref(&t.str[0], t.v.ppr.nr[2], t.v.ppr.nr[1], t.v.ppr.nr[0], t.v.ppr.c);
+		}
+		case term::REF: {
+			erlang_ref ref;
+			strncpy(ref.node, t.str(), sizeof(ref.node)-1);
+			ref.node[sizeof(ref.node)-1] = '\0';
+			ref.len = 0;
+			for (size_t i = 0; i < (size_t)t.v.ppr.n && i < NR_MAX && i < sizeof(ref.n)/sizeof(ref.n[0]); ++i) {
+				ref.n[i] = t.v.ppr.nr[i];
+				++ref.len;
+			}
+			ref.creation = t.v.ppr.c;
+			ei_encode_ref(buf, idx, &ref);
 			break;
+		}
 		case term::BINARY:
-			et = erl_mk_binary(&t.str[0], (int)t.str_len);
+			ei_encode_binary(buf, idx, t.str_len > 0 ? t.str() : NULL, (long)t.str_len);
 			break;
 		case term::INTEGER:
-			et = erl_mk_int(t.v.i);
+			ei_encode_long(buf, idx, t.v.i);
 			break;
 		case term::U_INTEGER:
-			et = erl_mk_uint(t.v.ui);
+			ei_encode_ulong(buf, idx, t.v.ui);
 			break;
 		case term::LONGLONG:
-			et = erl_mk_longlong(t.v.ll);
+			ei_encode_longlong(buf, idx, t.v.ll);
 			break;
 		case term::U_LONGLONG:
-			et = erl_mk_ulonglong(t.v.ull);
-			break;
-		case term::LIST: {
-			ETERM ** et_ms = new ETERM*[t.length()];
-			int i=0;
-			for (term::iterator it = t.begin() ; it != t.end(); ++it) {
-				et_ms[i] = stl_to_erlterm(*it);
-				++i;
-			}
-			et = erl_mk_list(et_ms, (int)t.length());
-            delete et_ms;
-					   }
-			break;
-		case term::TUPLE: {
-			ETERM ** et_ms = new ETERM*[t.length()];
-			int i=0;
-			for (term::iterator it = t.begin(); it != t.end(); ++it) {
-				et_ms[i] = stl_to_erlterm(*it);
-				++i;
+			ei_encode_ulonglong(buf, idx, t.v.ull);
+			break;
+		case term::LIST:
+			if (t.length() > 0) {
+				ei_encode_list_header(buf, idx, (int)t.length());
+				for (term::iterator it = t.begin() ; it != t.end(); ++it)
+					encode(buf, idx, *it);
 			}
-			et = erl_mk_tuple(et_ms, (int)t.length());
-            delete et_ms;
-						}
+			ei_encode_empty_list(buf, idx);
+			break;
+		case term::TUPLE:
+			ei_encode_tuple_header(buf, idx, (int)t.length());
+			for (term::iterator it = t.begin(); it != t.end(); ++it)
+				encode(buf, idx, *it);
 			break;
         default:
             break;
 	}
-	return et;
 }
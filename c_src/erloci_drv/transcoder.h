@@ -20,18 +20,14 @@
 
 #include "platform.h"
 
-#include "erl_interface.h"
 #include "ei.h"
 #include "term.h"
 
 class transcoder
 {
 private:
-	mutex_type transcoder_lock;
-	inline bool lock();
-	inline void unlock();
-	void erlterm_to_stl(ETERM *, term &);
-	ETERM * stl_to_erlterm(term &);
+	bool decode(const char *, int *, term &, bool);
+	void encode(char *, int *, term &);
 
 	transcoder(void);
 	transcoder(transcoder const&);      // Not implemented
@@ -43,10 +39,12 @@ public:
 		static transcoder t;
 		return t;
 	}
-	static inline void stats(unsigned long & allocated, unsigned long & freed) { erl_eterm_statistics(&allocated,&freed); };
-	void decode(vector<unsigned char> &, term &);
+	// with view the binaries of t point into buf, which must outlive t
+	void decode(vector<unsigned char> &, term &, bool view = false);
 	vector<unsigned char> encode(term &);
 	vector<unsigned char> encode_with_header(term &);
+	void append(term &, vector<unsigned char> &);
+	size_t encoded_size(term &);
 	inline ~transcoder(void) {};
 };
 
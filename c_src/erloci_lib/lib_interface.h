@@ -58,16 +58,21 @@ typedef struct var {
 	char name[256];
 	unsigned short dty;
 	ARG_DIR dir;
-	std::vector<void *> valuep;
 	std::vector<unsigned short> alen;
 	std::vector<signed short> ind;
 	unsigned short value_sz;
 	void *ocibind;
 	void *datap;
-	unsigned long datap_len;
+	unsigned long datap_len;	// rows * value_sz, values laid out column wise
+	unsigned long datap_cap;
 	var(char * _name = NULL, unsigned short _dty = 0)
 	{
 		dty = _dty;
+		value_sz = 0;
+		ocibind = NULL;
+		datap = NULL;
+		datap_len = 0;
+		datap_cap = 0;
 		if (_name != NULL)
 			strcpy((char*)name, _name);
 	}
@@ -80,6 +85,7 @@ typedef enum _INTF_RET {
     ERROR_VAL			= 3,
     MORE				= 4,
     DONE				= 5,
+    PENDING				= 6,	// non-blocking call still executing, issue it again to resume
 } INTF_RET;
 
 typedef struct intf_ret {
@@ -109,7 +115,7 @@ extern void checkerr0(intf_ret *, unsigned int, int, const char *, int);
 
 typedef struct _intf_funs
 {
-	size_t (*calculate_resp_size)(void *); // TODO
+	size_t (*calculate_resp_size)(void *); // encoded bytes of a row
 	void (*append_int_to_list)(const int, void *);
 	void (*append_float_to_list)(const unsigned char[4], void *);
 	void (*append_double_to_list)(const unsigned char[8], void *);
@@ -128,6 +134,7 @@ typedef struct _intf_funs
 	void (*append_bin_arg_tuple_to_list)(const unsigned char *, unsigned long long, const unsigned char *, unsigned long long, void *);
 	void (*append_int_arg_tuple_to_list)(const unsigned char *, unsigned long long, unsigned long long, void *);
 	void (*append_cur_arg_tuple_to_list)(const unsigned char *, unsigned long long, unsigned long long, unsigned long long, void *);
+	void (*append_err_tuple_to_list)(unsigned long long, int, const char *, size_t, void *);
 } intf_funs;
 
 #endif // OCI_LIB_INTF
\ No newline at end of file
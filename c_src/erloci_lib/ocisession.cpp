@@ -23,6 +23,19 @@
 
 void * ocisession::envhp = NULL;
 void * ocisession::stmt_lock = NULL;
+void * ocisession::pool_lock = NULL;
+void * ocisession::sess_lock = NULL;
+unsigned long long ocisession::call_seq = 0;
+bool ocisession::nb_enabled = false;
+
+unsigned int ocisession::spool_min = 1;
+unsigned int ocisession::spool_max = 16;
+unsigned int ocisession::spool_incr = 1;
+map<string, ocisession::spool> ocisession::_pools;
+
+unsigned int ocisession::stmt_cache_size = 32;
+unsigned long long ocisession::stmt_cache_hits = 0;
+unsigned long long ocisession::stmt_cache_misses = 0;
 
 intf_funs ocisession::intf;
 list<ocisession*> ocisession::_sessions;
@@ -63,12 +76,149 @@ void ocisession::config(intf_funs _intf)
 		r.handle = envhp;
 		checkenv(&r, ret);
 		if(r.fn_ret != SUCCESS)
+        throw r;
+		ret = OCIThreadMutexInit((OCIEnv*)envhp,
+                           (OCIError*)ehp, 
+                           (OCIThreadMutex**)&pool_lock);
+		checkenv(&r, ret);
+		if(r.fn_ret != SUCCESS)
+        throw r;
+		ret = OCIThreadMutexInit((OCIEnv*)envhp,
+                           (OCIError*)ehp, 
+                           (OCIThreadMutex**)&sess_lock);
+		checkenv(&r, ret);
+		if(r.fn_ret != SUCCESS)
         throw r;
 	}
 
 	REMOTE_LOG(INF, "OCI Initialized");
 }
 
+// spool_max 0 disables pooling, every session is then a dedicated one
+void ocisession::pool_config(unsigned int min, unsigned int max, unsigned int incr)
+{
+	spool_min = min;
+	spool_max = max;
+	spool_incr = (incr > 0 ? incr : 1);
+	if (spool_min > spool_max)
+		spool_min = spool_max;
+
+	REMOTE_LOG(INF, "session pool min %u max %u incr %u", spool_min, spool_max, spool_incr);
+}
+
+// size 0 disables the statement caches
+void ocisession::stmt_cache_config(unsigned int size)
+{
+	stmt_cache_size = size;
+
+	REMOTE_LOG(INF, "statement cache size %u", stmt_cache_size);
+}
+
+void ocisession::nonblocking_config(bool enable)
+{
+	nb_enabled = enable;
+
+	REMOTE_LOG(INF, "non-blocking execution %s", nb_enabled ? "enabled" : "disabled");
+}
+
+// counters only ever grow, a read racing an update is just one behind
+void ocisession::stmt_cache_stats(unsigned long long & hits, unsigned long long & misses)
+{
+	hits = stmt_cache_hits;
+	misses = stmt_cache_misses;
+}
+
+ocisession::spool * ocisession::get_pool(void * errhp,
+										 const char * connect_str, size_t connect_str_len,
+										 const char * user_name, size_t user_name_len,
+										 const char * password, size_t password_len)
+{
+	intf_ret r;
+
+	if (spool_max == 0)
+		return NULL;
+
+	string key(connect_str, connect_str_len);
+	key.append(1, '\0');
+	key.append(user_name, user_name_len);
+
+	ocilock scopelock(envhp,errhp,pool_lock);
+
+	map<string, spool>::iterator it = _pools.find(key);
+	if (it != _pools.end()) {
+		// the pool is homogeneous, it must not hand out sessions for a different password
+		if (it->second.password != string(password, password_len))
+			return NULL;
+		return &(it->second);
+	}
+
+	spool p;
+	p.poolhp = NULL;
+	p.name = NULL;
+	p.name_len = 0;
+	p.password.assign(password, password_len);
+
+	r.handle = envhp;
+	checkenv(&r, OCIHandleAlloc((OCIEnv*)envhp, (void**)&p.poolhp, OCI_HTYPE_SPOOL, (size_t)0, (void **)NULL));
+	if(r.fn_ret != SUCCESS) {
+   		REMOTE_LOG(ERR, "failed OCIHandleAlloc(OCI_HTYPE_SPOOL) %s\n", r.gerrbuf);
+        throw r;
+	}
+
+	// creating the pool opens spool_min sessions up front
+	r.handle = errhp;
+	checkerr(&r, OCISessionPoolCreate((OCIEnv*)envhp, (OCIError*)errhp, (OCISPool*)p.poolhp,
+									  (OraText**)&p.name, (ub4*)&p.name_len,
+									  (const OraText*)connect_str, (ub4)connect_str_len,
+									  (ub4)spool_min, (ub4)spool_max, (ub4)spool_incr,
+									  (OraText*)user_name, (ub4)user_name_len,
+									  (OraText*)password, (ub4)password_len,
+									  OCI_SPC_HOMOGENEOUS | (stmt_cache_size > 0 ? OCI_SPC_STMTCACHE : 0)));
+	if(r.fn_ret != SUCCESS) {
+		REMOTE_LOG(ERR, "failed OCISessionPoolCreate %s\n", r.gerrbuf);
+		(void) OCIHandleFree(p.poolhp, OCI_HTYPE_SPOOL);
+        throw r;
+	}
+
+	// commands (including releases) share the worker threads, a get must
+	// not wait for a session when the pool is exhausted but open a
+	// dedicated one instead
+	ub1 getmode = OCI_SPOOL_ATTRVAL_NOWAIT;
+	checkerr(&r, OCIAttrSet(p.poolhp, OCI_HTYPE_SPOOL, (void*)&getmode, (ub4)sizeof(getmode),
+							OCI_ATTR_SPOOL_GETMODE, (OCIError*)errhp));
+	if(r.fn_ret != SUCCESS)
+		REMOTE_LOG(ERR, "failed OCIAttrSet(OCI_ATTR_SPOOL_GETMODE) %s\n", r.gerrbuf);
+
+	REMOTE_LOG(INF, "created session pool %.*s for %.*s user %.*s\n", p.name_len, p.name, connect_str_len, connect_str, user_name_len, user_name);
+
+	return &(_pools[key] = p);
+}
+
+// creates the pool of connect string and user now instead of on the first
+// get, nothing to do if it exists already or pooling is off
+void ocisession::warm_pool(const char * connect_str, size_t connect_str_len,
+						   const char * user_name, size_t user_name_len,
+						   const char * password, size_t password_len)
+{
+	intf_ret r;
+	void * errhp = NULL;
+
+	r.handle = envhp;
+	checkenv(&r, OCIHandleAlloc((OCIEnv*)envhp, (void **) &errhp, OCI_HTYPE_ERROR, (size_t) 0, (void **) NULL));
+	if(r.fn_ret != SUCCESS) {
+   		REMOTE_LOG(ERR, "failed OCIHandleAlloc %s\n", r.gerrbuf);
+        throw r;
+	}
+
+	try {
+		get_pool(errhp, connect_str, connect_str_len, user_name, user_name_len, password, password_len);
+	} catch (intf_ret r) {
+		(void) OCIHandleFree(errhp, OCI_HTYPE_ERROR);
+		throw r;
+	}
+	(void) OCIHandleFree(errhp, OCI_HTYPE_ERROR);
+}
+
 ocisession::ocisession(const char * connect_str, size_t connect_str_len,
 					   const char * user_name, size_t user_name_len,
 					   const char * password, size_t password_len)
@@ -106,23 +256,79 @@ ocisession::ocisession(const char * connect_str, size_t connect_str_len,
 								OCI_ATTR_PASSWORD, (OCIError *)_errhp));
 
 
-    /* get the database connection */
+	spool * pool = get_pool(_errhp, connect_str, connect_str_len, user_name, user_name_len, password, password_len);
+
+    /* get the database connection, borrowed from the pool if any */
     checkerr(&r, OCISessionGet((OCIEnv*)envhp, (OCIError *)_errhp,
                                (OCISvcCtx**)&_svchp,					/* returned database connection */
                                authp,									/* initialized authentication handle */                               
-                               (OraText *) connect_str, (ub4)connect_str_len,/* connect string */
+                               (OraText *) (pool ? pool->name : connect_str),
+                               (ub4)(pool ? pool->name_len : connect_str_len),/* pool name or connect string */
                                NULL, 0, NULL, NULL, NULL,				/* session tagging parameters: optional */
-                               OCI_DEFAULT));					        /* modes */
+                               pool ? OCI_SESSGET_SPOOL : OCI_DEFAULT));/* modes */
+	if(r.fn_ret != SUCCESS && pool != NULL && r.gerrcode == ORA_POOL_EXHAUSTED) {
+		REMOTE_LOG(INF, "session pool %.*s exhausted, opening a dedicated session\n", pool->name_len, pool->name);
+		pool = NULL;
+		checkerr(&r, OCISessionGet((OCIEnv*)envhp, (OCIError *)_errhp, (OCISvcCtx**)&_svchp, authp,
+								   (OraText *) connect_str, (ub4)connect_str_len,
+								   NULL, 0, NULL, NULL, NULL, OCI_DEFAULT));
+	}
 	if(r.fn_ret != SUCCESS) {
 		REMOTE_LOG(ERR, "failed OCISessionGet %s\n", r.gerrbuf);
         throw r;
 	}
 
 	(void) OCIHandleFree(authp, OCI_HTYPE_AUTHINFO);
+	_pooled = (pool != NULL);
+
+	// OCI side cache, OCIStmtPrepare2 of a released statement text skips the parse
+	if (stmt_cache_size > 0) {
+		ub4 cache_size = stmt_cache_size;
+		checkerr(&r, OCIAttrSet(_svchp, OCI_HTYPE_SVCCTX, (void*)&cache_size, (ub4)0,
+								OCI_ATTR_STMTCACHESIZE, (OCIError *)_errhp));
+		if(r.fn_ret != SUCCESS)
+			REMOTE_LOG(ERR, "failed OCIAttrSet(OCI_ATTR_STMTCACHESIZE) %s\n", r.gerrbuf);
+	}
 
 	REMOTE_LOG(INF, "got session %p %.*s user %.*s\n", _svchp, connect_str_len, connect_str, user_name_len, user_name);
 
-	_sessions.push_back(this);
+	_srvhp = NULL;
+	_nb_mode = false;
+	_running = NULL;
+	_call_seq = 0;
+	_break_sent = false;
+	{
+		ocilock scopelock(envhp,_errhp,sess_lock);
+		_sessions.push_back(this);
+	}
+}
+
+// the attribute is a switch, setting it flips the mode
+void ocisession::nonblocking_mode(bool on)
+{
+	intf_ret r;
+	r.handle = _errhp;
+
+	if (_srvhp == NULL) {
+		checkerr(&r, OCIAttrGet(_svchp, OCI_HTYPE_SVCCTX, (dvoid *)&_srvhp, (ub4 *)0,
+								OCI_ATTR_SERVER, (OCIError *)_errhp));
+		if(r.fn_ret != SUCCESS) {
+			REMOTE_LOG(ERR, "failed OCIAttrGet(OCI_ATTR_SERVER) %s\n", r.gerrbuf);
+			throw r;
+		}
+	}
+
+	ub1 mode = 0;
+	checkerr(&r, OCIAttrGet(_srvhp, OCI_HTYPE_SERVER, (dvoid *)&mode, (ub4 *)0,
+							OCI_ATTR_NONBLOCKING_MODE, (OCIError *)_errhp));
+	if(r.fn_ret == SUCCESS && (mode != 0) != on)
+		checkerr(&r, OCIAttrSet(_srvhp, OCI_HTYPE_SERVER, (dvoid *)0, (ub4)0,
+								OCI_ATTR_NONBLOCKING_MODE, (OCIError *)_errhp));
+	if(r.fn_ret != SUCCESS) {
+		REMOTE_LOG(ERR, "failed OCI_ATTR_NONBLOCKING_MODE %s\n", r.gerrbuf);
+		throw r;
+	}
+	_nb_mode = on;
 }
 
 void ocisession::ping()
@@ -302,12 +508,52 @@ ocistmt* ocisession::prepare_stmt(OraText *stmt, size_t stmt_len)
 {
 	ocilock scopelock(envhp,_errhp,stmt_lock);
 
-	ocistmt * statement = new ocistmt(this, stmt, stmt_len);
+	ocistmt * statement = NULL;
+	map<string, list<ocistmt*>::iterator>::iterator it = _stmt_cache_idx.find(string((char*)stmt, stmt_len));
+	if (it != _stmt_cache_idx.end()) {
+		statement = *(it->second);
+		_stmt_cache.erase(it->second);
+		_stmt_cache_idx.erase(it);
+		++stmt_cache_hits;
+	} else {
+		statement = new ocistmt(this, stmt, stmt_len);
+		if (stmt_cache_size > 0)
+			++stmt_cache_misses;
+	}
 	_statements.push_back(statement);
 
 	return statement;
 }
 
+bool ocisession::cache_stmt(ocistmt *stmt)
+{
+	ocilock scopelock(envhp,_errhp,stmt_lock);
+
+	string sql(stmt->get_stmt_str());
+
+	// REF cursors have no text, one idle statement per text is enough
+	if (stmt_cache_size == 0 || sql.empty() || _stmt_cache_idx.find(sql) != _stmt_cache_idx.end())
+		return false;
+
+	list<ocistmt*>::iterator it = std::find(_statements.begin(), _statements.end(), stmt);
+	if (it == _statements.end())
+		return false;
+	_statements.erase(it);
+
+	stmt->reset();
+	_stmt_cache.push_front(stmt);
+	_stmt_cache_idx[sql] = _stmt_cache.begin();
+
+	while (_stmt_cache.size() > stmt_cache_size) {
+		ocistmt * lru = _stmt_cache.back();
+		_stmt_cache_idx.erase(string(lru->get_stmt_str()));
+		_stmt_cache.pop_back();
+		lru->del();
+	}
+
+	return true;
+}
+
 ocistmt* ocisession::make_stmt(void *stmt)
 {
 	ocilock scopelock(envhp,_errhp,stmt_lock);
@@ -344,15 +590,101 @@ bool ocisession::has_statement(ocistmt *stmt)
 	return found;
 }
 
+unsigned long long ocisession::begin_call(ocistmt *stmt)
+{
+	ocilock scopelock(envhp,_errhp,sess_lock);
+	// a pending call resumed keeps its number and a break sent meanwhile
+	if (_running != NULL && _nb_mode)
+		return _call_seq;
+	_running = stmt;
+	_break_sent = false;
+	_call_seq = ++call_seq;
+	return _call_seq;
+}
+
+// not throwing, also runs while an exception unwinds
+void ocisession::end_call(void)
+{
+	try {
+		ocilock scopelock(envhp,_errhp,sess_lock);
+		if (_running != NULL && _nb_mode)
+			return;
+		_running = NULL;
+		if (!_break_sent)
+			return;
+		_break_sent = false;
+
+		intf_ret r;
+		r.handle = _errhp;
+		checkerr(&r, OCIReset(_svchp, (OCIError*)_errhp));
+		if(r.fn_ret != SUCCESS)
+			REMOTE_LOG(ERR, "failed OCIReset %s\n", r.gerrbuf);
+	} catch (intf_ret r) {
+		REMOTE_LOG(ERR, "failed end of call %s\n", r.gerrbuf);
+	}
+}
+
+// runs on a worker other than the one blocked in the call to interrupt,
+// so it breaks with an error handle of its own
+bool ocisession::cancel(ocisession *sess, ocistmt *stmt, unsigned long long seq)
+{
+	intf_ret r;
+	void *errhp = NULL;
+	bool sent = false;
+
+	r.handle = envhp;
+	checkenv(&r, OCIHandleAlloc((OCIEnv*)envhp, (void **) &errhp, OCI_HTYPE_ERROR,
+								(size_t) 0, (void **) NULL));
+	if(r.fn_ret != SUCCESS) {
+		REMOTE_LOG(ERR, "failed OCIHandleAlloc %s\n", r.gerrbuf);
+		throw r;
+	}
+
+	try {
+		ocilock scopelock(envhp,errhp,sess_lock);
+		if (find(_sessions.begin(), _sessions.end(), sess) != _sessions.end()
+			&& sess->_running != NULL && (stmt == NULL || stmt == sess->_running)
+			&& (seq == 0 || seq == sess->_call_seq)) {
+			r.handle = errhp;
+			checkerr(&r, OCIBreak(sess->_svchp, (OCIError*)errhp));
+			if(r.fn_ret != SUCCESS) {
+				REMOTE_LOG(ERR, "failed OCIBreak %s\n", r.gerrbuf);
+				throw r;
+			}
+			sess->_break_sent = true;
+			sent = true;
+		}
+	} catch (...) {
+		(void) OCIHandleFree(errhp, OCI_HTYPE_ERROR);
+		throw;
+	}
+
+	(void) OCIHandleFree(errhp, OCI_HTYPE_ERROR);
+	return sent;
+}
+
 ocisession::~ocisession(void)
 {
 	intf_ret r;
 
+	// no cancel can reach the session from here on
+	{
+		ocilock scopelock(envhp,_errhp,sess_lock);
+		_sessions.remove(this);
+	}
+
 	// delete all the statements
 	for (list<ocistmt*>::iterator it = _statements.begin(); it != _statements.end(); ++it)
 		(*it)->del();
 	_statements.clear();
+	for (list<ocistmt*>::iterator it = _stmt_cache.begin(); it != _stmt_cache.end(); ++it)
+		(*it)->del();
+	_stmt_cache.clear();
+	_stmt_cache_idx.clear();
 
+	// pooled sessions are returned to their pool, without any open transaction
+	if (_pooled)
+		(void) OCITransRollback((OCISvcCtx*)_svchp, (OCIError*)_errhp, OCI_DEFAULT);
 	checkerr(&r, OCISessionRelease((OCISvcCtx*)_svchp, (OCIError*)_errhp, NULL, 0, OCI_DEFAULT));
 	if(r.fn_ret != SUCCESS) {
 		REMOTE_LOG(ERR, "failed OCISessionRelease %s\n", r.gerrbuf);
@@ -360,6 +692,4 @@ ocisession::~ocisession(void)
 	}
 
 	(void) OCIHandleFree(_errhp, OCI_HTYPE_ERROR);
-
-	_sessions.remove(this);
 }
\ No newline at end of file
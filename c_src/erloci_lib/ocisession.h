@@ -17,6 +17,8 @@
 
 #include <iostream>
 #include <list>
+#include <map>
+#include <string>
 
 #include "ocistmt.h"
 
@@ -26,12 +28,23 @@ class ocisession
 {
 public:
 	static void config(intf_funs);
+	static void pool_config(unsigned int min, unsigned int max, unsigned int incr);
+	static void warm_pool(const char * connect_str, size_t connect_str_len,
+		const char * user_name, size_t user_name_len,
+		const char * password, size_t password_len);
+	static void stmt_cache_config(unsigned int size);
+	static void stmt_cache_stats(unsigned long long & hits, unsigned long long & misses);
+	static void nonblocking_config(bool enable);
+	// single executions and first fetch round trips may return PENDING
+	static inline bool nonblocking() { return nb_enabled; };
 	static inline void * getenv() { return envhp; };
 
 	inline void *getsession() { return _svchp; }
 	ocisession(const char * connect_str, size_t connect_str_len,
 		const char * user_name, size_t user_name_len,
 		const char * password, size_t password_len);
+	// toggles OCI_ATTR_NONBLOCKING_MODE of the server handle
+	void nonblocking_mode(bool on);
 	void ping(void);
 	void commit(void);
 	void rollback(void);
@@ -39,8 +52,17 @@ public:
 	ocistmt* prepare_stmt(unsigned char *stmt, size_t stmt_len);
 	ocistmt* make_stmt(void *stmt);
 	void release_stmt(ocistmt *stmt);
+	bool cache_stmt(ocistmt *stmt);
 	bool has_statement(ocistmt *stmt);
 
+	// cancellable calls, a break sent meanwhile is reset by end_call,
+	// begin_call returns the number of the call, never reused by any session
+	unsigned long long begin_call(ocistmt *stmt);
+	void end_call(void);
+	// OCIBreak from any thread, true if sess was running stmt (any if NULL)
+	// and, unless seq is 0, still the call numbered seq
+	static bool cancel(ocisession *sess, ocistmt *stmt, unsigned long long seq = 0);
+
 	~ocisession(void);
 
 private:
@@ -48,10 +70,59 @@ private:
 	static void * envhp;
 	static void * stmt_lock;
 	static list<ocisession*> _sessions;
+	static void * sess_lock;
+	static unsigned long long call_seq;	// numbers the calls of all sessions
+	static bool nb_enabled;
+
+	// session pools keyed by connect string and user
+	typedef struct spool {
+		void *poolhp;
+		char *name;
+		unsigned int name_len;
+		string password;
+	} spool;
+	static void * pool_lock;
+	static unsigned int spool_min, spool_max, spool_incr;
+	static map<string, spool> _pools;
+	static spool * get_pool(void * errhp, const char * connect_str, size_t connect_str_len,
+		const char * user_name, size_t user_name_len,
+		const char * password, size_t password_len);
 
 	void *_svchp;
+	void *_srvhp;
+	bool _nb_mode;					// on only while a call is pending
 	void *_errhp;
+	bool _pooled;
 	list<ocistmt*> _statements;
+	ocistmt *_running;				// statement of the cancellable call
+	unsigned long long _call_seq;	// of the running call, unique in the port
+	bool _break_sent;
+
+	// closed statements by SQL text, most recently used first
+	static unsigned int stmt_cache_size;
+	static unsigned long long stmt_cache_hits, stmt_cache_misses;
+	list<ocistmt*> _stmt_cache;
+	map<string, list<ocistmt*>::iterator> _stmt_cache_idx;
+};
+
+// ORA-01013: user requested cancel of current operation
+#define ORA_CANCELLED	1013
+// ORA-24496: OCISessionGet() timed out waiting for a free connection
+#define ORA_POOL_EXHAUSTED	24496
+
+// begin_call / end_call around a cancellable call, also while unwinding
+class ocicall
+{
+	ocisession * sess_;
+	unsigned long long seq_;
+
+	ocicall(ocicall const&);			// Not implemented
+    void operator=(ocicall const&);	// Not implemented
+
+public:
+	ocicall(ocisession *sess, ocistmt *stmt) : sess_(sess) { seq_ = sess_->begin_call(stmt); }
+	~ocicall() { sess_->end_call(); }
+	inline unsigned long long seq() { return seq_; }
 };
 
 #endif // OCISESSION_H
\ No newline at end of file
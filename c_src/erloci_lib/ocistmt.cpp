@@ -17,6 +17,7 @@
 
 #ifndef __WIN32__
 #include <stdlib.h>
+#include <ctype.h>
 #include <netinet/in.h>
 #else
 #include <Winsock2.h>
@@ -24,6 +25,7 @@
 #endif
 
 #include <cstring>
+#include <time.h>
 #include <oci.h>
 
 struct column {
@@ -31,19 +33,45 @@ struct column {
     ub4	 dlen;
     ub2	 dprec;
     sb1	 dscale;
-	sb2  indp;
+	ub2  ftype;			// array define type, 0 if defined by execute (LOB, NTY)
+	ub4  vlen;			// size of one row in the define buffer
+	vector<sb2> indp;	// indicator per fetched row
+	vector<ub2> rlen;	// returned length per fetched row
 	ub4  rtype;
 	void * row_valp;
 	vector<OCILobLocator*> loblps;
 };
 
 intf_funs ocistmt::intf;
+unsigned int ocistmt::fetch_latency_ms = FETCH_LATENCY_MS;
 
 void ocistmt::config(intf_funs _intf)
 {
 	intf = _intf;
 }
 
+// 0 disables the latency target, responses are then bounded by rows and bytes only
+void ocistmt::fetch_config(unsigned int latency_ms)
+{
+	fetch_latency_ms = latency_ms;
+}
+
+// monotonic microseconds, times the array fetches
+static unsigned long long now_usec(void)
+{
+#ifdef __WIN32__
+	LARGE_INTEGER freq, cnt;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&cnt);
+	return (unsigned long long)((cnt.QuadPart / freq.QuadPart) * 1000000
+								+ (cnt.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+}
+
 ocistmt::ocistmt(void *ocisess, void *stmt)
 {
 	intf_ret r;
@@ -53,6 +81,19 @@ ocistmt::ocistmt(void *ocisess, void *stmt)
 	_svchp = ((ocisession *)ocisess)->getsession();
 	_iters = 1;
 	_ocisess = ocisess;
+	_fetch_cap = 0;
+	_row_cnt = 0;
+	_row_idx = 0;
+	_fetch_done = false;
+	_avg_row_bytes = 0;
+	_avg_row_usec = 0;
+	_last_rows = 0;
+	_last_bytes = 0;
+	_rowidhp = NULL;
+	_rowid_tried = false;
+	_pending = false;
+	_pending_rows = 0;
+	_pending_since = 0;
 		
 	_stmtstr = new char[1];
 	_stmtstr[0] = '\0';
@@ -91,6 +132,19 @@ ocistmt::ocistmt(void *ocisess, OraText *stmt, size_t stmt_len)
 	_svchp = ((ocisession *)ocisess)->getsession();
 	_iters = 1;
 	_ocisess = ocisess;
+	_fetch_cap = 0;
+	_row_cnt = 0;
+	_row_idx = 0;
+	_fetch_done = false;
+	_avg_row_bytes = 0;
+	_avg_row_usec = 0;
+	_last_rows = 0;
+	_last_bytes = 0;
+	_rowidhp = NULL;
+	_rowid_tried = false;
+	_pending = false;
+	_pending_rows = 0;
+	_pending_since = 0;
 		
 	_stmtstr = new char[stmt_len+1];
 	memcpy(_stmtstr, stmt, stmt_len);
@@ -108,18 +162,9 @@ ocistmt::ocistmt(void *ocisess, OraText *stmt, size_t stmt_len)
         throw r;
 	}
 
-	// allocate the statement handle
-	checkenv(&r, OCIHandleAlloc(envhp,					/* environment handle */
-                                (void **) &_stmthp,		/* returned statement handle */
-                                OCI_HTYPE_STMT,			/* typ of handle to allocate */
-                                (size_t) 0,				/* optional extra memory size */
-								(void **) NULL));		/* returned extra memeory */
-	if(r.fn_ret != SUCCESS) {
-   		REMOTE_LOG(ERR, "failed OCIHandleAlloc %s (%s)\n", r.gerrbuf, _stmtstr);
-        throw r;
-	}
-
-	/* Get a prepared statement handle */
+	/* Get a prepared statement handle, from the OCI statement cache if the
+	 * session has one, OCIStmtPrepare2 allocates it */
+	_stmthp = NULL;
 	r.handle = _errhp;
     checkerr(&r, OCIStmtPrepare2((OCISvcCtx*)_svchp,
                                  (OCIStmt**)&_stmthp,	/* returned statement handle */
@@ -146,6 +191,208 @@ ocistmt::ocistmt(void *ocisess, OraText *stmt, size_t stmt_len)
 		_iters = 0;
 }
 
+// length of sql without trailing blanks, comments and ';'
+static size_t sql_end(const char * sql)
+{
+	size_t end = 0;
+	char quote = 0;
+	for (size_t i = 0; sql[i] != '\0'; ++i) {
+		char c = sql[i];
+		if (quote) {
+			end = i + 1;
+			if (c == quote)
+				quote = 0;
+		} else if (c == '\'' || c == '"') {
+			quote = c;
+			end = i + 1;
+		} else if (c == '-' && sql[i+1] == '-') {
+			while (sql[i+1] != '\0' && sql[i+1] != '\n')
+				++i;
+		} else if (c == '/' && sql[i+1] == '*') {
+			for (i += 2; sql[i] != '\0' && !(sql[i] == '*' && sql[i+1] == '/'); ++i)
+				;
+			if (sql[i] == '\0')
+				break;
+			++i;
+		} else if (c != ';' && !isspace((unsigned char)c))
+			end = i + 1;
+	}
+	return end;
+}
+
+/*
+ * DML statements executed with more than one row of binds are re-prepared
+ * with a returning clause, so that a single array execute can hand back the
+ * rowid of every bound row. Statements the server can't parse that way
+ * (INSERT ... SELECT, views, an existing RETURNING clause) stay as they are
+ * and execute one row at a time.
+ */
+bool ocistmt::prepare_rowid_returning(void)
+{
+	intf_ret r;
+	r.handle = _errhp;
+
+	_rowid_tried = true;
+	string sql(_stmtstr, sql_end(_stmtstr));
+	sql += " RETURNING ROWID INTO " ROWID_BIND_NAME;
+
+	OCIStmt *stmthp = NULL;
+    checkerr(&r, OCIStmtPrepare2((OCISvcCtx*)_svchp, &stmthp, (OCIError*)_errhp,
+                                 (OraText *) sql.c_str(), (ub4)sql.length(),
+                                 NULL, 0, OCI_NTV_SYNTAX, OCI_DEFAULT));
+	if(r.fn_ret == SUCCESS)
+		checkerr(&r, OCIStmtExecute((OCISvcCtx*)_svchp, stmthp, (OCIError*)_errhp, 0, 0,
+									(OCISnapshot *)NULL, (OCISnapshot *)NULL, OCI_PARSE_ONLY));
+	if(r.fn_ret != SUCCESS) {
+		REMOTE_LOG(DBG, "rowid returning not possible %s (%s)\n", r.gerrbuf, _stmtstr);
+		if(stmthp)
+			(void) OCIStmtRelease(stmthp, (OCIError*)_errhp, (OraText *) NULL, 0, OCI_DEFAULT);
+		return false;
+	}
+
+	_rowidhp = stmthp;
+	return true;
+}
+
+typedef struct rowid_slot {
+	char rowid[ROWID_MAX_LEN];
+	ub4	 len;
+	sb2  ind;
+	ub2  rcode;
+	ub4  rows;	// rows returned by the iteration
+} rowid_slot;
+
+static sb4 rowid_in_cb(dvoid *ctxp, OCIBind *bindp, ub4 iter, ub4 index,
+					   dvoid **bufpp, ub4 *alenp, ub1 *piecep, dvoid **indpp)
+{
+	static sb2 null_ind = OCI_IND_NULL;
+	*bufpp = NULL;
+	*alenp = 0;
+	*indpp = &null_ind;
+	*piecep = OCI_ONE_PIECE;
+	return OCI_CONTINUE;
+}
+
+static sb4 rowid_out_cb(dvoid *ctxp, OCIBind *bindp, ub4 iter, ub4 index,
+						dvoid **bufpp, ub4 **alenp, ub1 *piecep, dvoid **indpp, ub2 **rcodepp)
+{
+	// UPDATE/DELETE may return many rows per iteration, the last one is kept
+	rowid_slot & slot = (*(vector<rowid_slot> *)ctxp)[iter];
+	slot.len = sizeof(slot.rowid);
+	slot.rows = index + 1;
+	*bufpp = slot.rowid;
+	*alenp = &slot.len;
+	*indpp = &slot.ind;
+	*rcodepp = &slot.rcode;
+	*piecep = OCI_ONE_PIECE;
+	return OCI_CONTINUE;
+}
+
+/*
+ * Executes all bound rows with one OCIStmtExecute, rows failing are
+ * reported in error_list as {Row, Code, Msg} and don't stop the others
+ */
+unsigned int ocistmt::execute_batch(void * rowid_list, void * error_list, bool auto_commit)
+{
+	intf_ret r;
+	r.handle = _errhp;
+	ocisession * ocisess = (ocisession *)_ocisess;
+	OCIEnv *envhp = (OCIEnv *)ocisession::getenv();
+
+	ub4 iters = (ub4)(_iters > 0 ? _iters : 1);
+	vector<rowid_slot> slots(iters);
+	for(size_t i = 0; i < slots.size(); ++i) {
+		slots[i].rowid[0] = '\0';
+		slots[i].ind = OCI_IND_NULL;
+		slots[i].rows = 0;
+	}
+
+	OCIBind *bndp = NULL;
+	checkerr(&r, OCIBindByName((OCIStmt*)_rowidhp, &bndp, (OCIError*)_errhp,
+							   (text*)ROWID_BIND_NAME, -1, NULL, ROWID_MAX_LEN, SQLT_STR,
+							   NULL, NULL, NULL, 0, NULL, OCI_DATA_AT_EXEC));
+	if(r.fn_ret == SUCCESS)
+		checkerr(&r, OCIBindDynamic(bndp, (OCIError*)_errhp, &slots, rowid_in_cb, &slots, rowid_out_cb));
+	if(r.fn_ret != SUCCESS) {
+		REMOTE_LOG(ERR, "failed binding rowid returning error %s (%s)\n", r.gerrbuf, _stmtstr);
+		ocisess->release_stmt(this);
+		throw r;
+	}
+
+	checkerr(&r, OCIStmtExecute((OCISvcCtx*)_svchp, (OCIStmt*)_rowidhp, (OCIError*)_errhp, iters, 0,
+								(OCISnapshot *)NULL, (OCISnapshot *)NULL,
+								OCI_BATCH_ERRORS));
+	if(r.fn_ret != SUCCESS) {
+		REMOTE_LOG(ERR, "failed OCIStmtExecute error %s (%s)\n", r.gerrbuf, _stmtstr);
+		if(auto_commit) OCITransRollback((OCISvcCtx*)_svchp, (OCIError*)_errhp, OCI_DEFAULT);
+		ocisess->release_stmt(this);
+		throw r;
+	}
+
+	ub4 num_errs = 0;
+	checkerr(&r, OCIAttrGet(_rowidhp, OCI_HTYPE_STMT, &num_errs, 0, OCI_ATTR_NUM_DML_ERRORS, (OCIError*)_errhp));
+	if(r.fn_ret != SUCCESS) {
+		REMOTE_LOG(ERR, "failed OCIAttrGet(OCI_ATTR_NUM_DML_ERRORS) error %s (%s)\n", r.gerrbuf, _stmtstr);
+		ocisess->release_stmt(this);
+		throw r;
+	}
+
+	for(ub4 i = 0; i < num_errs; ++i) {
+		OCIError *errhp = NULL;
+		ub4 row_off = 0;
+		sb4 errcode = 0;
+		text errbuf[512];
+		errbuf[0] = '\0';
+		// OCIParamGet fills an error handle allocated by the caller
+		r.handle = envhp;
+		checkenv(&r, OCIHandleAlloc(envhp, (void **) &errhp, OCI_HTYPE_ERROR, (size_t) 0, (void **) NULL));
+		r.handle = _errhp;
+		if(r.fn_ret == SUCCESS)
+			checkerr(&r, OCIParamGet(_errhp, OCI_HTYPE_ERROR, (OCIError*)_errhp, (dvoid **)&errhp, i));
+		if(r.fn_ret == SUCCESS)
+			checkerr(&r, OCIAttrGet(errhp, OCI_HTYPE_ERROR, &row_off, 0, OCI_ATTR_DML_ROW_OFFSET, (OCIError*)_errhp));
+		if(r.fn_ret != SUCCESS) {
+			REMOTE_LOG(ERR, "failed reading batch error %d error %s (%s)\n", i, r.gerrbuf, _stmtstr);
+			if(errhp)
+				(void) OCIHandleFree(errhp, OCI_HTYPE_ERROR);
+			ocisess->release_stmt(this);
+			throw r;
+		}
+		(void) OCIErrorGet(errhp, 1, (text *) NULL, &errcode, errbuf, (ub4)sizeof(errbuf), OCI_HTYPE_ERROR);
+		(void) OCIHandleFree(errhp, OCI_HTYPE_ERROR);
+		(*intf.append_err_tuple_to_list)(row_off, errcode, (const char*)errbuf, strlen((char*)errbuf), error_list);
+		if(row_off < slots.size())
+			slots[row_off].rows = 0;
+	}
+
+	// only the errors are returned, with auto commit none of the rows is
+	// applied, else the good ones are left to the caller's commit or rollback
+	if(num_errs > 0) {
+		REMOTE_LOG(ERR, "%u of %u rows failed (%s)\n", num_errs, iters, _stmtstr);
+		if(auto_commit) OCITransRollback((OCISvcCtx*)_svchp, (OCIError*)_errhp, OCI_DEFAULT);
+		return iters;
+	}
+
+	// returned RowID is only valid if anything was changed at all
+	for(size_t i = 0; i < slots.size(); ++i) {
+		if(slots[i].rows > 0 && slots[i].ind != OCI_IND_NULL)
+			(*intf.append_string_to_list)(slots[i].rowid, strlen(slots[i].rowid), rowid_list);
+		else
+			(*intf.append_string_to_list)(NULL, 0, rowid_list);
+	}
+
+	if(auto_commit) {
+		checkerr(&r, OCITransCommit((OCISvcCtx*)_svchp, (OCIError*)_errhp, OCI_DEFAULT));
+		if(r.fn_ret != SUCCESS) {
+			REMOTE_LOG(ERR, "failed OCITransCommit error %s (%s)\n", r.gerrbuf, _stmtstr);
+			ocisess->release_stmt(this);
+			throw r;
+		}
+	}
+
+	return iters;
+}
+
 /* Allocate and define the descriptor (storage) for the datatype */
 #define OCIALLOC(__desctype, __dtypestr)																	\
 {	cur_clm.row_valp = NULL;																				\
@@ -163,15 +410,21 @@ ocistmt::ocistmt(void *ocisess, OraText *stmt, size_t stmt_len)
 	OCIDefine *__dfnp = NULL;																				\
     checkerr(&r, OCIDefineByPos((OCIStmt*)_stmthp, &__dfnp, (OCIError*)_errhp,								\
 								num_cols, (dvoid *)(cur_clm.row_valp),										\
-								(sword) cur_clm.dlen + 1, __datatype, &(cur_clm.indp), (ub2 *)0,			\
+								(sword) cur_clm.dlen + 1, __datatype, &(cur_clm.indp[0]), (ub2 *)0,			\
                                 (ub2 *)0, OCI_DEFAULT));													\
 	if(r.fn_ret != SUCCESS) {																				\
 		REMOTE_LOG(ERR, "failed OCIDefineByPos for %p column %d("__dtypestr")\n", _stmthp, num_cols);		\
 		throw r;																							\
 	}																										\
 }
+/* Scalar columns are array defined by define_columns() on the first fetch */
+#define OCIARRDEF(__datatype)																				\
+{	cur_clm.rtype = LCL_DTYPE_NONE;																			\
+	cur_clm.ftype = __datatype;																				\
+	cur_clm.vlen = cur_clm.dlen + 1;																		\
+}
 
-unsigned int ocistmt::execute(void * column_list, void * rowid_list, void * out_list, bool auto_commit)
+unsigned int ocistmt::execute(void * column_list, void * rowid_list, void * out_list, void * error_list, bool auto_commit)
 {
 	ub4 row_count = 0;
 	intf_ret r;
@@ -181,53 +434,18 @@ unsigned int ocistmt::execute(void * column_list, void * rowid_list, void * out_
 
 	r.handle = _errhp;
 
-	/* bind variables if any */
-	size_t dat_len = 0;
-	for(unsigned int i = 0; i < _argsin.size(); ++i) {
-		for(unsigned int j = 0; j < _argsin[i].alen.size(); ++j) {
-			//unsigned short * alenarr = &_argsin[i].alen[0];
-			void ** valueparr = &_argsin[i].valuep[0];
-			switch(_argsin[i].dty) {
-				case SQLT_IBFLOAT:
-				case SQLT_BFLOAT:
-				case SQLT_FLT:
-					dat_len = sizeof(float);
-					break;
-				case SQLT_IBDOUBLE:
-				case SQLT_BDOUBLE:
-					dat_len = sizeof(double);
-					break;
-				case SQLT_INT:
-					dat_len = sizeof(int);
-					break;
-				default:
-					dat_len = _argsin[i].value_sz;
-					break;
-			}
-			_argsin[i].datap = realloc(_argsin[i].datap, _argsin[i].datap_len + dat_len);
-			memcpy((char*)_argsin[i].datap + _argsin[i].datap_len, valueparr[j], _argsin[i].alen[j]);
-			_argsin[i].datap_len += (unsigned long)(dat_len);
-		}
-		switch(_argsin[i].dty) {
-			case SQLT_BFLOAT:
-			case SQLT_IBFLOAT:
-				_argsin[i].dty = SQLT_FLT;
-				break;
-			case SQLT_BDOUBLE:
-			case SQLT_IBDOUBLE:
-				_argsin[i].dty = SQLT_BDOUBLE;
-				break;
-			case SQLT_TIMESTAMP:     _argsin[i].dty = INT_SQLT_TIMESTAMP;     break;
-			case SQLT_TIMESTAMP_TZ:  _argsin[i].dty = INT_SQLT_TIMESTAMP_TZ;  break;
-			case SQLT_TIMESTAMP_LTZ: _argsin[i].dty = INT_SQLT_TIMESTAMP_LTZ; break;
-			case SQLT_INTERVAL_YM:   _argsin[i].dty = INT_SQLT_INTERVAL_YM;   break;
-			case SQLT_INTERVAL_DS:   _argsin[i].dty = INT_SQLT_INTERVAL_DS;   break;
-		}		
-	}
-
-	if(_argsin.size() > 0)
-		_iters = _argsin[0].valuep.size();
-	for(size_t i = 0; i < _argsin.size(); ++i) {
+	/* bind variables if any, values are already in place in var::datap,
+	 * a resumed execute is bound already */
+	if(_argsin.size() > 0 && !_pending)
+		_iters = _argsin[0].alen.size();
+
+	// rows of an array execute come back with their rowid, a single row keeps
+	// the plain statement and its error shape
+	bool batch = false;
+	if(_iters > 1 && (_stmt_typ == OCI_STMT_INSERT || _stmt_typ == OCI_STMT_UPDATE || _stmt_typ == OCI_STMT_DELETE))
+		batch = (_rowidhp != NULL || (!_rowid_tried && prepare_rowid_returning()));
+	void * bindhp = (batch ? _rowidhp : _stmthp);
+	for(size_t i = 0; i < _argsin.size() && !_pending; ++i) {
 		if(_argsin[i].dty == SQLT_RSET) {
 
 			if(_argsin[i].datap != NULL)
@@ -246,16 +464,27 @@ unsigned int ocistmt::execute(void * column_list, void * rowid_list, void * out_
 			}
 			r.handle = _errhp;
 			_argsin[i].value_sz = 0;
-			checkerr(&r, OCIBindByName((OCIStmt*)_stmthp, (OCIBind**)(&_argsin[i].ocibind), (OCIError*)_errhp,
+			checkerr(&r, OCIBindByName((OCIStmt*)bindhp, (OCIBind**)(&_argsin[i].ocibind), (OCIError*)_errhp,
 										(text*)(_argsin[i].name), -1,
 										&(_argsin[i].datap), _argsin[i].value_sz, _argsin[i].dty,
 										(dvoid*)NULL, (ub2*)NULL, (ub2*)NULL, 0, (ub4*)NULL,
 										OCI_DEFAULT));
 		} else {
-			checkerr(&r, OCIBindByName((OCIStmt*)_stmthp, (OCIBind**)(&_argsin[i].ocibind), (OCIError*)_errhp,
+			ub2 dty = _argsin[i].dty;
+			switch(dty) {
+				case SQLT_BFLOAT:
+				case SQLT_IBFLOAT:       dty = SQLT_FLT;               break;
+				case SQLT_IBDOUBLE:      dty = SQLT_BDOUBLE;           break;
+				case SQLT_TIMESTAMP:     dty = INT_SQLT_TIMESTAMP;     break;
+				case SQLT_TIMESTAMP_TZ:  dty = INT_SQLT_TIMESTAMP_TZ;  break;
+				case SQLT_TIMESTAMP_LTZ: dty = INT_SQLT_TIMESTAMP_LTZ; break;
+				case SQLT_INTERVAL_YM:   dty = INT_SQLT_INTERVAL_YM;   break;
+				case SQLT_INTERVAL_DS:   dty = INT_SQLT_INTERVAL_DS;   break;
+			}
+			checkerr(&r, OCIBindByName((OCIStmt*)bindhp, (OCIBind**)(&_argsin[i].ocibind), (OCIError*)_errhp,
 										(text*)(_argsin[i].name), -1,
 										_argsin[i].datap, _argsin[i].value_sz,
-										_argsin[i].dty,
+										dty,
 										&_argsin[i].ind[0], &_argsin[i].alen[0],
 										(ub2*)NULL,0,
 										(ub4*)NULL, OCI_DEFAULT));
@@ -267,12 +496,28 @@ unsigned int ocistmt::execute(void * column_list, void * rowid_list, void * out_
 		}
 	}
 
-	if (_stmtstr[0] != '\0') { // REF Cursors do not require Stmt Release
+	if (_stmtstr[0] != '\0' && batch) {
+		row_count = execute_batch(rowid_list, error_list, auto_commit);
+	} else if (_stmtstr[0] != '\0') { // REF Cursors do not require Stmt Release
+		// a single execution may run non-blocking, the worker is then free
+		// until the call is issued again
+		bool nb = (_iters <= 1 && ocisess->nonblocking());
 		do {
 			/* execute the statement one at a time with retrive row-id */
-			checkerr(&r, OCIStmtExecute((OCISvcCtx*)_svchp, (OCIStmt*)_stmthp, (OCIError*)_errhp, (_stmt_typ == OCI_STMT_SELECT ? 0 : row_count+1), row_count,
+			if (nb)
+				ocisess->nonblocking_mode(true);
+			sword st = OCIStmtExecute((OCISvcCtx*)_svchp, (OCIStmt*)_stmthp, (OCIError*)_errhp, (_stmt_typ == OCI_STMT_SELECT ? 0 : row_count+1), row_count,
 										(OCISnapshot *)NULL, (OCISnapshot *)NULL,
-										OCI_DEFAULT));
+										OCI_DEFAULT);
+			if (nb && st == OCI_STILL_EXECUTING) {
+				_pending = true;
+				r.fn_ret = PENDING;
+				throw r;
+			}
+			_pending = false;
+			if (nb)
+				ocisess->nonblocking_mode(false);
+			checkerr(&r, st);
 			if(r.fn_ret != SUCCESS) {
 				REMOTE_LOG(ERR, "failed OCIStmtExecute error %s (%s)\n", r.gerrbuf, _stmtstr);
 				if(auto_commit) OCITransRollback((OCISvcCtx*)_svchp, (OCIError*)_errhp, OCI_DEFAULT);
@@ -370,7 +615,7 @@ unsigned int ocistmt::execute(void * column_list, void * rowid_list, void * out_
 					REMOTE_LOG(ERR, "failed OCIObjectFree for %p column %d reason %s (%s)\n", _stmthp, i, r.gerrbuf, _stmtstr);
 			} else {
 				if(_columns[i]->rtype == LCL_DTYPE_NONE)
-					delete (char*)(_columns[i]->row_valp);
+					delete [] (char*)(_columns[i]->row_valp);
 				else {
 					ub4 trtype = _columns[i]->rtype;
 					vector<OCILobLocator *> & tlobps = _columns[i]->loblps;
@@ -384,6 +629,10 @@ unsigned int ocistmt::execute(void * column_list, void * rowid_list, void * out_
 			delete _columns[i];
 		}
 		_columns.clear();
+		_fetch_cap = 0;
+		_row_cnt = 0;
+		_row_idx = 0;
+		_fetch_done = false;
 
 		while (parm_status == OCI_SUCCESS) {
 			column *_clm = new column;
@@ -392,6 +641,10 @@ unsigned int ocistmt::execute(void * column_list, void * rowid_list, void * out_
             cur_clm.dtype = 0;
 			cur_clm.dprec = 0;
 			cur_clm.dscale = 0;
+			cur_clm.ftype = 0;
+			cur_clm.vlen = 0;
+			cur_clm.indp.resize(1, 0);
+			cur_clm.rlen.resize(1, 0);
 			cur_clm.row_valp = NULL;
 
 			/* Retrieve the data size attribute */
@@ -443,17 +696,11 @@ unsigned int ocistmt::execute(void * column_list, void * rowid_list, void * out_
 			switch (cur_clm.dtype) {
             case SQLT_BFLOAT:
 			case SQLT_IBFLOAT:
-				cur_clm.row_valp = new unsigned char[4];
-				memset(cur_clm.row_valp, 0, sizeof(float));
-				cur_clm.rtype = LCL_DTYPE_NONE;
-				OCIDEF(SQLT_IBFLOAT, "SQLT_IBFLOAT");
+				OCIARRDEF(SQLT_IBFLOAT);
 				break;
             case SQLT_BDOUBLE:
 			case SQLT_IBDOUBLE:
-				cur_clm.row_valp = new unsigned char[8];
-				memset(cur_clm.row_valp, 0, sizeof(double));
-				cur_clm.rtype = LCL_DTYPE_NONE;
-				OCIDEF(SQLT_IBDOUBLE, "SQLT_IBDOUBLE");
+				OCIARRDEF(SQLT_IBDOUBLE);
 				break;
             case SQLT_FLT:
 			case SQLT_INT:
@@ -461,86 +708,55 @@ unsigned int ocistmt::execute(void * column_list, void * rowid_list, void * out_
             case SQLT_VNU:
             case SQLT_NUM:
 				cur_clm.dlen = OCI_NUMBER_SIZE;
-				cur_clm.row_valp = new OCINumber;
-				memset(cur_clm.row_valp, 0, sizeof(OCINumber));
-				cur_clm.rtype = LCL_DTYPE_NONE;
-				OCIDEF(SQLT_VNU, "SQLT_VNU");
+				OCIARRDEF(SQLT_VNU);
 				break;
             case SQLT_AVC:
             case SQLT_AFC:
             case SQLT_CHR:
             case SQLT_STR:
             case SQLT_VCS:
-				cur_clm.row_valp = new text[cur_clm.dlen + 1];
-				cur_clm.rtype = LCL_DTYPE_NONE;
-				OCIDEF(SQLT_STR, "SQLT_STR");
+				OCIARRDEF(SQLT_STR);
                 break;
 			case SQLT_BIN: // RAW
-				cur_clm.row_valp = new unsigned char[cur_clm.dlen + 1];
-				memset(cur_clm.row_valp, 0, (cur_clm.dlen + 1)*sizeof(unsigned char));
-				cur_clm.rtype = LCL_DTYPE_NONE;
-				OCIDEF(SQLT_BIN, "SQLT_BIN");
+				OCIARRDEF(SQLT_BIN);
 				break;
 			// 5 bytes buffer
             case SQLT_INTERVAL_YM:
 				cur_clm.dlen = (cur_clm.dlen < 5 ? 5 : cur_clm.dlen);
-				cur_clm.row_valp = new unsigned char[cur_clm.dlen];
-				memset(cur_clm.row_valp, 0, cur_clm.dlen);
-				cur_clm.rtype = LCL_DTYPE_NONE;
-				OCIDEF(INT_SQLT_INTERVAL_YM, "INT_SQLT_INTERVAL_YM");
+				OCIARRDEF(INT_SQLT_INTERVAL_YM);
                 break;
 			// 7 bytes buffer
             case SQLT_DAT:
 				cur_clm.dlen = (cur_clm.dlen < 7 ? 7 : cur_clm.dlen);
-				cur_clm.row_valp = new unsigned char[cur_clm.dlen];
-				memset(cur_clm.row_valp, 0, cur_clm.dlen);
-				cur_clm.rtype = LCL_DTYPE_NONE;
-				OCIDEF(SQLT_DAT, "SQLT_DAT");
+				OCIARRDEF(SQLT_DAT);
                 break;
 			// 11 bytes buffers
             case SQLT_DATE:
 				cur_clm.dlen = (cur_clm.dlen < 11 ? 11 : cur_clm.dlen);
-				cur_clm.row_valp = new unsigned char[cur_clm.dlen];
-				memset(cur_clm.row_valp, 0, cur_clm.dlen);
-				cur_clm.rtype = LCL_DTYPE_NONE;
-				OCIDEF(SQLT_DATE, "SQLT_DATE");
+				OCIARRDEF(SQLT_DATE);
                 break;
             case SQLT_TIMESTAMP:
 				cur_clm.dlen = (cur_clm.dlen < 11 ? 11 : cur_clm.dlen);
-				cur_clm.row_valp = new unsigned char[cur_clm.dlen];
-				memset(cur_clm.row_valp, 0, cur_clm.dlen);
-				cur_clm.rtype = LCL_DTYPE_NONE;
-				OCIDEF(INT_SQLT_TIMESTAMP, "INT_SQLT_TIMESTAMP");
+				OCIARRDEF(INT_SQLT_TIMESTAMP);
                 break;
             case SQLT_TIMESTAMP_LTZ:
 				cur_clm.dlen = (cur_clm.dlen < 11 ? 11 : cur_clm.dlen);
-				cur_clm.row_valp = new unsigned char[cur_clm.dlen];
-				memset(cur_clm.row_valp, 0, cur_clm.dlen);
-				cur_clm.rtype = LCL_DTYPE_NONE;
-				OCIDEF(INT_SQLT_TIMESTAMP_LTZ, "INT_SQLT_TIMESTAMP_LTZ");
+				OCIARRDEF(INT_SQLT_TIMESTAMP_LTZ);
                 break;
             case SQLT_INTERVAL_DS:
 				cur_clm.dlen = (cur_clm.dlen < 11 ? 11 : cur_clm.dlen);
-				cur_clm.row_valp = new unsigned char[cur_clm.dlen];
-				memset(cur_clm.row_valp, 0, cur_clm.dlen);
-				cur_clm.rtype = LCL_DTYPE_NONE;
-				OCIDEF(INT_SQLT_INTERVAL_DS, "INT_SQLT_INTERVAL_DS");
+				OCIARRDEF(INT_SQLT_INTERVAL_DS);
                 break;
 			// 13 bytes buffer
             case SQLT_TIMESTAMP_TZ:
 				cur_clm.dlen = (cur_clm.dlen < 13 ? 13 : cur_clm.dlen);
-				cur_clm.row_valp = new unsigned char[cur_clm.dlen];
-				memset(cur_clm.row_valp, 0, cur_clm.dlen);
-				cur_clm.rtype = LCL_DTYPE_NONE;
-				OCIDEF(INT_SQLT_TIMESTAMP_TZ, "INT_SQLT_TIMESTAMP_TZ");
+				OCIARRDEF(INT_SQLT_TIMESTAMP_TZ);
                 break;
 			// 19 bytes buffer
 			case SQLT_RDD:
 			case SQLT_RID:
 				cur_clm.dlen = (cur_clm.dlen < 19 ? 19 : cur_clm.dlen);
-				cur_clm.row_valp = new text[cur_clm.dlen + 1];
-				cur_clm.rtype = LCL_DTYPE_NONE;
-				OCIDEF(SQLT_STR, "SQLT_STR");
+				OCIARRDEF(SQLT_STR);
                 break;
 			case SQLT_CLOB: {
 				OCIALLOC(OCI_DTYPE_LOB, "SQLT_CLOB");
@@ -669,7 +885,7 @@ for (ub2 pos = 1; pos <= count; pos++)
 				OCIDefine *defnp = NULL;
 				checkerr(&r, OCIDefineByPos((OCIStmt*)_stmthp, &defnp, (OCIError*)_errhp,
 											num_cols, (dvoid *)(cur_clm.row_valp),
-											(sword) cur_clm.dlen + 1, SQLT_NTY, &(cur_clm.indp), (ub2*)0,
+											(sword) cur_clm.dlen + 1, SQLT_NTY, &(cur_clm.indp[0]), (ub2*)0,
 											(ub2 *)0, OCI_DEFAULT));
 				if(r.fn_ret != SUCCESS) {
 					REMOTE_LOG(ERR, "failed OCIDefineByPos for %p column %d(SQLT_NTY)\n", _stmthp, num_cols);
@@ -768,16 +984,12 @@ for (ub2 pos = 1; pos <= count; pos++)
 		}
 	}
 
-	// Clear the in/out/inout arguments (if any)
+	// Clear the in/out/inout arguments (if any), buffers are kept for the next execute
 	for(unsigned int i = 0; i < _argsin.size(); ++i) {
-		if(_argsin[i].datap && _argsin[i].dty != SQLT_RSET) {
-			free(_argsin[i].datap);
-			_argsin[i].datap = NULL;
-		}
 		_argsin[i].datap_len = 0;
 		_argsin[i].value_sz = 0;
-		_argsin[i].valuep.clear();
 		_argsin[i].alen.clear();
+		_argsin[i].ind.clear();
 	}
 
 	if (row_count < 2) {
@@ -792,14 +1004,81 @@ for (ub2 pos = 1; pos <= count; pos++)
 	return row_count;
 }
 
+void ocistmt::define_columns(unsigned int nrows)
+{
+	intf_ret r;
+	r.handle = _errhp;
+
+	// LOB and object columns are defined with single row buffers by execute
+	size_t row_width = 0;
+	for (unsigned int i = 0; i < _columns.size(); ++i) {
+		if (_columns[i]->ftype == 0)
+			nrows = 1;
+		row_width += _columns[i]->vlen;
+	}
+	if (row_width > 0 && nrows * row_width > FETCH_ARRAY_BUFFER_SIZE)
+		nrows = (unsigned int)(FETCH_ARRAY_BUFFER_SIZE / row_width);
+	if (nrows < 1)
+		nrows = 1;
+	if (_fetch_cap >= nrows)
+		return;
+
+	for (unsigned int i = 0; i < _columns.size(); ++i) {
+		column & cur_clm = *_columns[i];
+		if (cur_clm.ftype == 0)
+			continue;
+
+		delete [] (char*)(cur_clm.row_valp);
+		cur_clm.row_valp = new char[cur_clm.vlen * nrows];
+		cur_clm.indp.resize(nrows, 0);
+		cur_clm.rlen.resize(nrows, 0);
+
+		OCIDefine *dfnp = NULL;
+		checkerr(&r, OCIDefineByPos((OCIStmt*)_stmthp, &dfnp, (OCIError*)_errhp,
+									i + 1, (dvoid *)(cur_clm.row_valp),
+									(sword) cur_clm.vlen, cur_clm.ftype, &(cur_clm.indp[0]), &(cur_clm.rlen[0]),
+									(ub2 *)0, OCI_DEFAULT));
+		if(r.fn_ret != SUCCESS) {
+			REMOTE_LOG(ERR, "failed OCIDefineByPos for %p column %d type %d reason %s (%s)\n", _stmthp, i + 1, cur_clm.ftype, r.gerrbuf, _stmtstr);
+			throw r;
+		}
+	}
+	_fetch_cap = nrows;
+}
+
+/* Rows of the next array fetch: what is left of the requested count,
+ * of the byte budget at the learned row width and of the latency target
+ * at the learned fetch time per row. Before the first batch the define
+ * buffer width stands in for the row width. */
+unsigned int ocistmt::fetch_size(unsigned int rows_left, size_t bytes_left, unsigned long long usec_left)
+{
+	size_t row_width = _avg_row_bytes;
+	if (row_width == 0)
+		for (unsigned int i = 0; i < _columns.size(); ++i)
+			row_width += _columns[i]->vlen;
+
+	unsigned long long nrows = rows_left;
+	if (row_width > 0 && bytes_left / row_width < nrows)
+		nrows = bytes_left / row_width;
+	if (_avg_row_usec > 0 && usec_left / _avg_row_usec < nrows)
+		nrows = usec_left / _avg_row_usec;
+	return (nrows < 1 ? 1 : (unsigned int)nrows);
+}
+
 intf_ret ocistmt::rows(void * row_list, unsigned int maxrowcount)
+{
+	return rows(row_list, maxrowcount, intf);
+}
+
+// rows appended to row_list through fns, intf builds terms
+intf_ret ocistmt::rows(void * row_list, unsigned int maxrowcount, const intf_funs & fns)
 {
 	intf_ret r;
 
 	r.handle = _errhp;
     unsigned int num_rows = 0;
-    sword res = OCI_NO_DATA;
-	size_t total_est_row_size = 0;
+    sword res = OCI_SUCCESS;
+	size_t total_row_size = 0, max_row_size = 0;
 	OCIEnv *envhp = (OCIEnv *)ocisession::getenv();
 
 	r.fn_ret = FAILURE;
@@ -809,163 +1088,228 @@ intf_ret ocistmt::rows(void * row_list, unsigned int maxrowcount)
 	}
 	r.fn_ret = SUCCESS;
 
-    // overdrive preventation
-    if(maxrowcount > 100)
-        maxrowcount = 100;
+	if(maxrowcount < 1)
+		maxrowcount = 1;
+	_last_rows = 0;
+	_last_bytes = 0;
+
+	// byte budget of the rows in one response, the widest row so far
+	// predicts the next one so that a batch stays within the budget
+	size_t row_budget = (max_term_byte_size > RESP_ENVELOPE_SIZE ? max_term_byte_size - RESP_ENVELOPE_SIZE : 0);
+	unsigned long long latency_budget = fetch_latency_ms * 1000ULL;
+	unsigned long long started = now_usec();
 
 	void * row = NULL;
-    do {
-        ++num_rows;
-		//if(num_rows % 100 == 0) REMOTE_LOG("OCI: Fetched %lu rows of %d bytes\n", num_rows, total_est_row_size);
-        res = OCIStmtFetch((OCIStmt*)_stmthp, (OCIError*)_errhp, 1, OCI_FETCH_NEXT, OCI_DEFAULT);
-		checkerr(&r, res);
-		if(r.fn_ret != SUCCESS) {
-			REMOTE_LOG(ERR, "failed OCIStmtFetch for %p row %d reason %s (%s)\n", _stmthp, num_rows, r.gerrbuf, _stmtstr);
-		    throw r;
-		}
+    while (num_rows < maxrowcount
+		   && (num_rows == 0 || total_row_size + max_row_size <= row_budget)) {
 
-		if (res != OCI_NO_DATA) {
-	        row = (*intf.child_list)(row_list);
-			for (unsigned int i = 0; i < _columns.size(); ++i) {
-					switch (_columns[i]->dtype) {
-					case SQLT_FLT:
-					case SQLT_BFLOAT:
-					case SQLT_IBFLOAT: // NULL is empty binary
-						if(_columns[i]->indp < 0)
-							(*intf.append_string_to_list)("", 0, row);
-						else
-							(*intf.append_float_to_list)((const unsigned char*)(_columns[i]->row_valp), row);
-						memset(_columns[i]->row_valp, 0, sizeof(float));
-						break;
-					case SQLT_BDOUBLE:
-					case SQLT_IBDOUBLE: // NULL is empty binary
-						if(_columns[i]->indp < 0)
-							(*intf.append_string_to_list)("", 0, row);
-						else
-							(*intf.append_double_to_list)((const unsigned char*)(_columns[i]->row_valp), row);
-						memset(_columns[i]->row_valp, 0, sizeof(double));
-						break;
-					case SQLT_INT:
-					case SQLT_UIN:
-					case SQLT_VNU:
-					case SQLT_NUM:
-						(*intf.append_string_to_list)((char*)(_columns[i]->row_valp), _columns[i]->dlen, row);
-						memset(_columns[i]->row_valp, 0, sizeof(OCINumber));
-						break;
-					case SQLT_DAT:
-					case SQLT_DATE:
-					case SQLT_TIMESTAMP:
-					case SQLT_TIMESTAMP_TZ:
-					case SQLT_TIMESTAMP_LTZ:
-					case SQLT_INTERVAL_YM:
-					case SQLT_INTERVAL_DS:
-						(*intf.append_string_to_list)((char*)(_columns[i]->row_valp), _columns[i]->dlen, row);
-						memset(_columns[i]->row_valp, 0, _columns[i]->dlen);
-						break;
-					case SQLT_BFILE: {
-							OCILobLocator *_tlob;
-							oraub8 loblen = 0;
-							checkerr(&r, OCILobGetLength2((OCISvcCtx*)_svchp, (OCIError*)_errhp, (OCILobLocator*)(_columns[i]->row_valp), &loblen));
-							if(r.fn_ret != SUCCESS) {
-								REMOTE_LOG(ERR, "failed OCILobGetLength for %p row %d column %d reason %s (%s)\n", _stmthp, num_rows, i, r.gerrbuf, _stmtstr);
-								throw r;
-							}
-							r.handle = envhp;
-							checkerr(&r, OCIDescriptorAlloc(envhp, (dvoid **)&_tlob, (ub4)(_columns[i]->rtype), (size_t)0, (dvoid **)0));
-							if(r.fn_ret != SUCCESS) {
-								REMOTE_LOG(ERR, "failed OCIDescriptorAlloc for %p column %d reason %s (%s)\n", _stmthp, i, r.gerrbuf, _stmtstr);
-								throw r;
-							}
-							r.handle = _errhp;
-							checkerr(&r, OCILobLocatorAssign((OCISvcCtx*)_svchp, (OCIError*)_errhp, (OCILobLocator*)(_columns[i]->row_valp), &_tlob));
-							if(r.fn_ret != SUCCESS) {
-								REMOTE_LOG(ERR, "failed OCILobLocatorAssign for %p column %d reason %s (%s)\n", _stmthp, i, r.gerrbuf, _stmtstr);
-								throw r;
-							}
-							text dir[31], file[256];
-							ub2 dlen = sizeof(dir)/sizeof(dir[0]), flen = sizeof(file)/sizeof(file[0]);
-							checkerr(&r, OCILobFileGetName(envhp, (OCIError*)_errhp, _tlob, dir, &dlen, file, &flen));
-							if(r.fn_ret != OCI_SUCCESS) {
-								REMOTE_LOG(ERR, "failed OCILobFileGetName for %p column %d reason %s (%s)\n", _stmthp, i, r.gerrbuf, _stmtstr);
-								throw r;
-							}
-							(*intf.append_ext_tuple_to_list)((unsigned long long)_tlob, (unsigned long long)loblen, (const char*)dir, dlen, (const char*)file, flen, row);
-							_columns[i]->loblps.push_back(_tlob);
-						break;
-					}
-					case SQLT_CLOB:
-					case SQLT_BLOB: {
-							OCILobLocator *_tlob;
-							unsigned long long loblen = 0;
-							checkerr(&r, OCILobGetLength2((OCISvcCtx*)_svchp, (OCIError*)_errhp, (OCILobLocator*)(_columns[i]->row_valp), (oraub8*)&loblen));
-							if(r.fn_ret != SUCCESS) {
-								REMOTE_LOG(ERR, "failed OCILobGetLength for %p row %d column %d reason %s (%s)\n", _stmthp, num_rows, i, r.gerrbuf, _stmtstr);
-								throw r;
-							}
-							r.handle = envhp;
-							checkerr(&r, OCIDescriptorAlloc(envhp, (dvoid **)&_tlob, (ub4)(_columns[i]->rtype), (size_t)0, (dvoid **)0));
-							if(r.fn_ret != SUCCESS) {
-								REMOTE_LOG(ERR, "failed OCIDescriptorAlloc for %p column %d reason %s (%s)\n", _stmthp, i, r.gerrbuf, _stmtstr);
-								throw r;
-							}
-							r.handle = _errhp;
-							checkerr(&r, OCILobLocatorAssign((OCISvcCtx*)_svchp, (OCIError*)_errhp, (OCILobLocator*)(_columns[i]->row_valp), &_tlob));
-							if(r.fn_ret != SUCCESS) {
-								REMOTE_LOG(ERR, "failed OCILobLocatorAssign for %p column %d reason %s (%s)\n", _stmthp, i, r.gerrbuf, _stmtstr);
-								throw r;
-							}
-							(*intf.append_tuple_to_list)((unsigned long long)_tlob, loblen, row);
-							_columns[i]->loblps.push_back(_tlob);
-						break;
-					}
-					case SQLT_CHR: {
-						size_t str_len = _columns[i]->dlen;
-						if(str_len > 0) // Handling for non NULL column
-							str_len = strlen((char*)(_columns[i]->row_valp));
-						(*intf.append_string_to_list)((char*)(_columns[i]->row_valp), str_len, row);
-						memset(_columns[i]->row_valp, 0, _columns[i]->dlen);
-						break;
-					}
-					case SQLT_BIN:
-					case SQLT_RID:
-					case SQLT_RDD:
-					case SQLT_AFC:
-					case SQLT_STR: {
-						size_t str_len = strlen((char*)(_columns[i]->row_valp));
-						(*intf.append_string_to_list)((char*)(_columns[i]->row_valp), str_len, row);
-						memset(_columns[i]->row_valp, 0, str_len);
-						break;
-					}
-					case SQLT_NTY:
-						(*intf.append_string_to_list)((char*)(_columns[i]->row_valp), _columns[i]->dlen, row);
-						memset(_columns[i]->row_valp, 0, _columns[i]->dlen);
-						break;
-					default:
-						r.fn_ret = FAILURE;
-						SPRINT(r.gerrbuf, sizeof(r.gerrbuf), "[%s:%d] unsupporetd type %u\n", __FUNCTION__, __LINE__, _columns[i]->dtype);
-						REMOTE_LOG(ERR, "%s at row %d column %d (%s)\n", r.gerrbuf, num_rows, i, _stmtstr);
-						throw r;
-						break;
-					}
+		// rows left over from the last array fetch are delivered first
+		if (_row_idx >= _row_cnt) {
+			if (_fetch_done)
+				break;
+
+			// the latency target is only checked between round trips
+			unsigned long long elapsed = now_usec() - started;
+			if (latency_budget > 0 && num_rows > 0 && elapsed >= latency_budget)
+				break;
+
+			// the first round trip of a call may run non-blocking, a
+			// resumed one keeps its array size and define buffers
+			bool nb = (num_rows == 0 && ((ocisession *)_ocisess)->nonblocking());
+			ub4 nrows = _pending_rows;
+			if (!_pending) {
+				nrows = fetch_size(maxrowcount - num_rows, row_budget - total_row_size,
+								   latency_budget > elapsed ? latency_budget - elapsed : 0);
+				define_columns(nrows);
+				for (unsigned int i = 0; i < _columns.size(); ++i)
+					if (_columns[i]->ftype != 0)
+						memset(_columns[i]->row_valp, 0, _columns[i]->vlen * _fetch_cap);
+
+				if (nrows > _fetch_cap)
+					nrows = _fetch_cap;
+				_pending_since = now_usec();
+			}
+			if (nb)
+				((ocisession *)_ocisess)->nonblocking_mode(true);
+			res = OCIStmtFetch2((OCIStmt*)_stmthp, (OCIError*)_errhp, nrows, OCI_FETCH_NEXT, 0, OCI_DEFAULT);
+			if (nb && res == OCI_STILL_EXECUTING) {
+				_pending = true;
+				_pending_rows = nrows;
+				r.fn_ret = PENDING;
+				return r;
 			}
-			total_est_row_size += (*intf.calculate_resp_size)(row);
+			_pending = false;
+			if (nb)
+				((ocisession *)_ocisess)->nonblocking_mode(false);
+			unsigned long long fetch_usec = now_usec() - _pending_since;
+			checkerr(&r, res);
+			if(r.fn_ret != SUCCESS) {
+				REMOTE_LOG(ERR, "failed OCIStmtFetch2 for %p row %d reason %s (%s)\n", _stmthp, num_rows, r.gerrbuf, _stmtstr);
+				throw r;
+			}
+			if (res == OCI_NO_DATA)
+				_fetch_done = true;
+
+			ub4 fetched = 0;
+			checkerr(&r, OCIAttrGet(_stmthp, OCI_HTYPE_STMT, &fetched, 0, OCI_ATTR_ROWS_FETCHED, (OCIError*)_errhp));
+			if(r.fn_ret != SUCCESS) {
+				REMOTE_LOG(ERR, "failed OCIAttrGet(OCI_ATTR_ROWS_FETCHED) for %p reason %s (%s)\n", _stmthp, r.gerrbuf, _stmtstr);
+				throw r;
+			}
+			_row_cnt = fetched;
+			_row_idx = 0;
+			if (_row_cnt == 0)
+				break;
+			fetch_usec /= _row_cnt;
+			_avg_row_usec = (_avg_row_usec == 0 ? fetch_usec : (3 * _avg_row_usec + fetch_usec) / 4);
+			if (_avg_row_usec == 0)
+				_avg_row_usec = 1;
 		}
-    } while (res != OCI_NO_DATA
-			&& num_rows < maxrowcount
-			&& total_est_row_size < max_term_byte_size);
+
+		ub4 k = _row_idx++;
+		++num_rows;
+        row = (*fns.child_list)(row_list);
+		for (unsigned int i = 0; i < _columns.size(); ++i) {
+				column & c = *_columns[i];
+				char * valp = (char*)(c.row_valp) + c.vlen * k;
+				switch (c.dtype) {
+				case SQLT_FLT:
+				case SQLT_BFLOAT:
+				case SQLT_IBFLOAT: // NULL is empty binary
+					if(c.indp[k] < 0)
+						(*fns.append_string_to_list)("", 0, row);
+					else
+						(*fns.append_float_to_list)((const unsigned char*)valp, row);
+					break;
+				case SQLT_BDOUBLE:
+				case SQLT_IBDOUBLE: // NULL is empty binary
+					if(c.indp[k] < 0)
+						(*fns.append_string_to_list)("", 0, row);
+					else
+						(*fns.append_double_to_list)((const unsigned char*)valp, row);
+					break;
+				case SQLT_INT:
+				case SQLT_UIN:
+				case SQLT_VNU:
+				case SQLT_NUM:
+				case SQLT_DAT:
+				case SQLT_DATE:
+				case SQLT_TIMESTAMP:
+				case SQLT_TIMESTAMP_TZ:
+				case SQLT_TIMESTAMP_LTZ:
+				case SQLT_INTERVAL_YM:
+				case SQLT_INTERVAL_DS:
+					(*fns.append_string_to_list)(valp, c.dlen, row);
+					break;
+				case SQLT_BFILE: {
+						OCILobLocator *_tlob;
+						oraub8 loblen = 0;
+						checkerr(&r, OCILobGetLength2((OCISvcCtx*)_svchp, (OCIError*)_errhp, (OCILobLocator*)(c.row_valp), &loblen));
+						if(r.fn_ret != SUCCESS) {
+							REMOTE_LOG(ERR, "failed OCILobGetLength for %p row %d column %d reason %s (%s)\n", _stmthp, num_rows, i, r.gerrbuf, _stmtstr);
+							throw r;
+						}
+						r.handle = envhp;
+						checkerr(&r, OCIDescriptorAlloc(envhp, (dvoid **)&_tlob, (ub4)(c.rtype), (size_t)0, (dvoid **)0));
+						if(r.fn_ret != SUCCESS) {
+							REMOTE_LOG(ERR, "failed OCIDescriptorAlloc for %p column %d reason %s (%s)\n", _stmthp, i, r.gerrbuf, _stmtstr);
+							throw r;
+						}
+						r.handle = _errhp;
+						checkerr(&r, OCILobLocatorAssign((OCISvcCtx*)_svchp, (OCIError*)_errhp, (OCILobLocator*)(c.row_valp), &_tlob));
+						if(r.fn_ret != SUCCESS) {
+							REMOTE_LOG(ERR, "failed OCILobLocatorAssign for %p column %d reason %s (%s)\n", _stmthp, i, r.gerrbuf, _stmtstr);
+							throw r;
+						}
+						text dir[31], file[256];
+						ub2 dlen = sizeof(dir)/sizeof(dir[0]), flen = sizeof(file)/sizeof(file[0]);
+						checkerr(&r, OCILobFileGetName(envhp, (OCIError*)_errhp, _tlob, dir, &dlen, file, &flen));
+						if(r.fn_ret != OCI_SUCCESS) {
+							REMOTE_LOG(ERR, "failed OCILobFileGetName for %p column %d reason %s (%s)\n", _stmthp, i, r.gerrbuf, _stmtstr);
+							throw r;
+						}
+						(*fns.append_ext_tuple_to_list)((unsigned long long)_tlob, (unsigned long long)loblen, (const char*)dir, dlen, (const char*)file, flen, row);
+						c.loblps.push_back(_tlob);
+					break;
+				}
+				case SQLT_CLOB:
+				case SQLT_BLOB: {
+						OCILobLocator *_tlob;
+						unsigned long long loblen = 0;
+						checkerr(&r, OCILobGetLength2((OCISvcCtx*)_svchp, (OCIError*)_errhp, (OCILobLocator*)(c.row_valp), (oraub8*)&loblen));
+						if(r.fn_ret != SUCCESS) {
+							REMOTE_LOG(ERR, "failed OCILobGetLength for %p row %d column %d reason %s (%s)\n", _stmthp, num_rows, i, r.gerrbuf, _stmtstr);
+							throw r;
+						}
+						r.handle = envhp;
+						checkerr(&r, OCIDescriptorAlloc(envhp, (dvoid **)&_tlob, (ub4)(c.rtype), (size_t)0, (dvoid **)0));
+						if(r.fn_ret != SUCCESS) {
+							REMOTE_LOG(ERR, "failed OCIDescriptorAlloc for %p column %d reason %s (%s)\n", _stmthp, i, r.gerrbuf, _stmtstr);
+							throw r;
+						}
+						r.handle = _errhp;
+						checkerr(&r, OCILobLocatorAssign((OCISvcCtx*)_svchp, (OCIError*)_errhp, (OCILobLocator*)(c.row_valp), &_tlob));
+						if(r.fn_ret != SUCCESS) {
+							REMOTE_LOG(ERR, "failed OCILobLocatorAssign for %p column %d reason %s (%s)\n", _stmthp, i, r.gerrbuf, _stmtstr);
+							throw r;
+						}
+						(*fns.append_tuple_to_list)((unsigned long long)_tlob, loblen, row);
+						c.loblps.push_back(_tlob);
+					break;
+				}
+				case SQLT_CHR: {
+					size_t str_len = c.dlen;
+					if(str_len > 0) // Handling for non NULL column
+						str_len = strlen(valp);
+					(*fns.append_string_to_list)(valp, str_len, row);
+					break;
+				}
+				case SQLT_BIN: // RAW may contain '\0', use the returned length
+					(*fns.append_string_to_list)(valp, (c.indp[k] < 0 ? 0 : c.rlen[k]), row);
+					break;
+				case SQLT_RID:
+				case SQLT_RDD:
+				case SQLT_AFC:
+				case SQLT_STR:
+					(*fns.append_string_to_list)(valp, strlen(valp), row);
+					break;
+				case SQLT_NTY:
+					(*fns.append_string_to_list)((char*)(c.row_valp), c.dlen, row);
+					memset(c.row_valp, 0, c.dlen);
+					break;
+				default:
+					r.fn_ret = FAILURE;
+					SPRINT(r.gerrbuf, sizeof(r.gerrbuf), "[%s:%d] unsupporetd type %u\n", __FUNCTION__, __LINE__, c.dtype);
+					REMOTE_LOG(ERR, "%s at row %d column %d (%s)\n", r.gerrbuf, num_rows, i, _stmtstr);
+					throw r;
+					break;
+				}
+		}
+		size_t row_size = (*fns.calculate_resp_size)(row);
+		total_row_size += row_size;
+		if (row_size > max_row_size)
+			max_row_size = row_size;
+    }
 
 	if(r.fn_ret != SUCCESS) {
 		REMOTE_LOG(CRT, "this should never happen reason %s (%s)\n", r.gerrbuf, _stmtstr);
         throw r;
 	}
 
+	// weighted towards history so that a single odd batch does not swing the next fetch
+	if (num_rows > 0) {
+		size_t row_bytes = total_row_size / num_rows;
+		_avg_row_bytes = (_avg_row_bytes == 0 ? row_bytes : (3 * _avg_row_bytes + row_bytes) / 4);
+	}
+	_last_rows = num_rows;
+	_last_bytes = total_row_size;
+
     //REMOTE_LOG("Port: Returning Rows...\n");
-	if(res != OCI_NO_DATA)
+	if(!_fetch_done || _row_idx < _row_cnt)
 		r.fn_ret = MORE;
 	else
 		r.fn_ret = DONE;
 
-	//Sleep(50000);
 	return r;
 }
 
@@ -1061,10 +1405,27 @@ intf_ret ocistmt::lob(void * data, void * _lob, unsigned long long offset, unsig
 
 void ocistmt::close()
 {
+	// parked in the session statement cache unless it is full or disabled
+	if (((ocisession *)_ocisess)->cache_stmt(this))
+		return;
 	((ocisession *)_ocisess)->release_stmt(this);
 	delete this;
 }
 
+// drop binds and fetch state so that a cached statement looks freshly prepared
+void ocistmt::reset()
+{
+	for (unsigned int i = 0; i < _argsin.size(); ++i)
+		if(_argsin[i].dty != SQLT_RSET)
+			free(_argsin[i].datap);
+	_argsin.clear();
+	_argsout.clear();
+	_iters = (_stmt_typ == OCI_STMT_SELECT ? 0 : 1);
+	_row_cnt = 0;
+	_row_idx = 0;
+	_fetch_done = false;
+}
+
 ocistmt::~ocistmt(void)
 {
 	intf_ret r;
@@ -1077,7 +1438,7 @@ ocistmt::~ocistmt(void)
 				REMOTE_LOG(ERR, "failed OCIObjectFree for %p column %d reason %s (%s)\n", _stmthp, i, r.gerrbuf, _stmtstr);
 		} else {
 			if(_columns[i]->rtype == LCL_DTYPE_NONE)
-				delete (char*)(_columns[i]->row_valp);
+				delete [] (char*)(_columns[i]->row_valp);
 			else {
 				ub4 trtype = _columns[i]->rtype;
 				vector<OCILobLocator *> & tlobps = _columns[i]->loblps;
@@ -1092,16 +1453,24 @@ ocistmt::~ocistmt(void)
 	}
 	_columns.clear();
 
-	if (_stmtstr[0] != '\0') { // REF Cursors do not require Stmt Release
+	for (unsigned int i = 0; i < _argsin.size(); ++i)
+		if(_argsin[i].dty != SQLT_RSET)
+			free(_argsin[i].datap);
+	_argsin.clear();
+
+	if (_stmtstr[0] != '\0') {
+		// back into the OCI statement cache, the handle is OCI's again and
+		// must not be freed
 		r.handle = _errhp;
+		if(_rowidhp != NULL)
+			(void) OCIStmtRelease((OCIStmt*)_rowidhp, (OCIError*)_errhp, (OraText *) NULL, 0, OCI_DEFAULT);
 		checkerr(&r, OCIStmtRelease((OCIStmt*)_stmthp, (OCIError*)_errhp, (OraText *) NULL, 0, OCI_DEFAULT));
 		if(r.fn_ret != SUCCESS) {
 			REMOTE_LOG(ERR, "failed OCIStmtRelease %s (%s)\n", r.gerrbuf, _stmtstr);
 			throw r;
 		}
-	}
-
-	(void) OCIHandleFree(_stmthp, OCI_HTYPE_STMT);
+	} else // REF Cursors were allocated with OCIHandleAlloc
+		(void) OCIHandleFree(_stmthp, OCI_HTYPE_STMT);
 	(void) OCIHandleFree(_errhp, OCI_HTYPE_ERROR);
 
 	delete _stmtstr;
@@ -35,6 +35,14 @@ typedef struct column column;
 #define INT_SQLT_INTERVAL_YM	182	//  5 bytes
 #define INT_SQLT_INTERVAL_DS	183 // 11 bytes
 
+#define FETCH_ARRAY_BUFFER_SIZE	0x00100000UL // upper bound of define buffers per statement
+
+#define RESP_ENVELOPE_SIZE		1024 // {Ref, FTCH_ROWS, {{rows, ...}, Done, {fetched, N, Bytes}}} around the rows
+#define FETCH_LATENCY_MS		500	// default time budget of one fetch response
+
+#define ROWID_BIND_NAME		":ERLOCI_ROWID__"
+#define ROWID_MAX_LEN		128
+
 class ocistmt
 {
 public:
@@ -42,17 +50,26 @@ public:
 	ocistmt(void *ocisess, unsigned char *stmt, size_t stmt_len);
 	inline void del() { delete this; };
 
-	unsigned int execute(void * column_list, void * rowid_list, void * out_list, bool);
+	unsigned int execute(void * column_list, void * rowid_list, void * out_list, void * error_list, bool);
 	inline vector<var> & get_in_bind_args() { return _argsin; };
 	inline vector<var> & get_out_bind_args() { return _argsout; };
+	inline const char * get_stmt_str() { return _stmtstr; };
+	inline unsigned int fetched_rows() { return _last_rows; };
+	inline size_t fetched_bytes() { return _last_bytes; };
+	// a non-blocking execute or fetch is still executing, the same call resumes it
+	inline bool pending() { return _pending; };
 	intf_ret rows(void * row_list, unsigned int maxrowcount);
+	intf_ret rows(void * row_list, unsigned int maxrowcount, const intf_funs & fns);
 	intf_ret lob(void * data, void * lob, unsigned long long offset, unsigned long long length);
 	void close(void);
+	void reset(void);
 
 	static void config(intf_funs);
+	static void fetch_config(unsigned int latency_ms);
 
 private:
 	static intf_funs intf;
+	static unsigned int fetch_latency_ms;
 
 	char *_stmtstr;
 	void *_svchp;
@@ -62,8 +79,25 @@ private:
 	size_t _iters;
 	unsigned int _stmt_typ;
 	vector<column *> _columns;
+	unsigned int _fetch_cap;	// rows in the column define buffers
+	unsigned int _row_cnt;		// rows returned by the last array fetch
+	unsigned int _row_idx;		// next of those rows to deliver
+	bool _fetch_done;
+	size_t _avg_row_bytes;		// learned encoded row width, survives re-execution and caching
+	unsigned long long _avg_row_usec;	// learned OCIStmtFetch2 time per row
+	unsigned int _last_rows;	// rows and bytes delivered by the last rows() call
+	size_t _last_bytes;
+	void *_rowidhp;				// DML re-prepared with the ROWID_BIND_NAME returning clause
+	bool _rowid_tried;			// for the first execute of more than one row
+	bool _pending;				// OCI_STILL_EXECUTING, see ocisession::nonblocking()
+	unsigned int _pending_rows;	// array size of the pending fetch
+	unsigned long long _pending_since;
 	vector<var> _argsin;
 	vector<var> _argsout;
+	void define_columns(unsigned int);
+	unsigned int fetch_size(unsigned int rows_left, size_t bytes_left, unsigned long long usec_left);
+	bool prepare_rowid_returning(void);
+	unsigned int execute_batch(void * rowid_list, void * error_list, bool);
 	~ocistmt(void);
 };
 
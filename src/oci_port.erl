@@ -24,6 +24,7 @@
     stop/1,
     logging/2,
     get_session/4,
+    warm_pool/4,
     describe/3,
     prep_sql/2,
     ping/1,
@@ -34,11 +35,15 @@
     exec_stmt/1,
     exec_stmt/2,
     exec_stmt/3,
+    exec_stmt/4,
     fetch_rows/2,
+    fetch_rows/3,
     keep_alive/2,
     close/1,
     close/2,
-    echo/2
+    echo/2,
+    stats/1,
+    cancel/1
 ]).
 
 -export([
@@ -59,7 +64,8 @@
     waiting_resp = false,
     logging = ?DBG_FLAG_OFF,
     logger,
-    lastcmd
+    lastcmd,
+    deadline = infinity
 }).
 
 -define(log(__Lgr,__Flag, __Format, __Args), if __Flag == ?DBG_FLAG_ON -> ?Info(__Lgr, __Format, __Args); true -> ok end).
@@ -95,6 +101,9 @@ echo(Term, {?MODULE, PortPid}) ->
         Return -> Return
     end.
 
+stats({?MODULE, PortPid}) ->
+    gen_server:call(PortPid, {port_call, [?PORT_STAT]}, ?PORT_TIMEOUT).
+
 get_session(Tns, Usr, Pswd, {?MODULE, PortPid})
 when is_binary(Tns); is_binary(Usr); is_binary(Pswd) ->
     case gen_server:call(PortPid, {port_call, [?GET_SESSN, Tns, Usr, Pswd]}, ?PORT_TIMEOUT) of
@@ -102,6 +111,12 @@ when is_binary(Tns); is_binary(Usr); is_binary(Pswd) ->
         SessionId -> {?MODULE, PortPid, SessionId}
     end.
 
+% opens the session pool of Tns and Usr with its min sessions ahead of
+% the first get_session
+warm_pool(Tns, Usr, Pswd, {?MODULE, PortPid})
+when is_binary(Tns); is_binary(Usr); is_binary(Pswd) ->
+    gen_server:call(PortPid, {port_call, [?WARM_POOL, Tns, Usr, Pswd]}, ?PORT_TIMEOUT).
+
 close({?MODULE, statement, _, _, _} = Ctx)  -> close(ignore_port, Ctx);
 close({?MODULE, _, _} = Ctx)                -> close(ignore_port, Ctx);
 close({?MODULE, PortPid}) ->
@@ -148,6 +163,13 @@ commit({?MODULE, PortPid, SessionId}) ->
 rollback({?MODULE, PortPid, SessionId}) ->
     gen_server:call(PortPid, {port_call, [?RBK_SESSN, SessionId]}, ?PORT_TIMEOUT).
 
+% interrupts the exec_stmt or fetch_rows running on the session (or only
+% the one of the statement), which then returns {error, cancelled}
+cancel({?MODULE, statement, PortPid, SessionId, StmtId}) ->
+    gen_server:call(PortPid, {port_call, [?CMD_CANCEL, SessionId, StmtId]}, ?PORT_TIMEOUT);
+cancel({?MODULE, PortPid, SessionId}) ->
+    gen_server:call(PortPid, {port_call, [?CMD_CANCEL, SessionId, 0]}, ?PORT_TIMEOUT).
+
 describe(Object, Type, {?MODULE, PortPid, SessionId})
 when is_binary(Object); is_atom(Type) ->
     R = gen_server:call(PortPid, {port_call, [?CMD_DSCRB, SessionId, Object, ?DT(Type)]}, ?PORT_TIMEOUT),
@@ -172,10 +194,20 @@ exec_stmt({?MODULE, statement, PortPid, SessionId, StmtId}) ->
 exec_stmt(BindVars, {?MODULE, statement, PortPid, SessionId, StmtId}) ->
     exec_stmt(BindVars, 1, {?MODULE, statement, PortPid, SessionId, StmtId}).
 exec_stmt(BindVars, AutoCommit, {?MODULE, statement, PortPid, SessionId, StmtId}) ->
+    exec_stmt(BindVars, AutoCommit, [], {?MODULE, statement, PortPid, SessionId, StmtId}).
+%% Opts [{deadline, Ms}] overrides the deadline of the port for this call
+exec_stmt(BindVars, AutoCommit, Opts, {?MODULE, statement, PortPid, SessionId, StmtId}) ->
     GroupedBindVars = split_binds(BindVars,?MAX_REQ_SIZE),
-    collect_grouped_bind_request(GroupedBindVars, PortPid, SessionId, StmtId, AutoCommit, []).
+    collect_grouped_bind_request(GroupedBindVars, PortPid, SessionId, StmtId, AutoCommit, 0, [], port_call(Opts)).
+
+%% {port_call, Msg, Deadline} with the deadline of Opts, else the port's one
+port_call(Opts) ->
+    case proplists:get_value(deadline, Opts) of
+        Ms when is_integer(Ms), Ms >= 0 -> fun(Msg) -> {port_call, Msg, Ms} end;
+        _ -> fun(Msg) -> {port_call, Msg} end
+    end.
 
-collect_grouped_bind_request([], _, _, _, _, Acc) ->
+collect_grouped_bind_request([], _, _, _, _, _, Acc, _) ->
     UniqueResponses = sets:to_list(sets:from_list(Acc)),
     Results = lists:foldl(fun({K, Vs}, Res) ->
                                   case lists:keyfind(K, 1, Res) of
@@ -189,15 +221,20 @@ collect_grouped_bind_request([], _, _, _, _, Acc) ->
         [Result] -> Result;
         _ -> Results
     end;
-collect_grouped_bind_request([BindVars|GroupedBindVars], PortPid, SessionId, StmtId, AutoCommit, Acc) ->
+collect_grouped_bind_request([BindVars|GroupedBindVars], PortPid, SessionId, StmtId, AutoCommit, Start, Acc, PortCall) ->
     NewAutoCommit = if length(GroupedBindVars) > 0 -> 0; true -> AutoCommit end,
     %if length(BindVars) > 0 -> io:format(user,"TX rows ~p~n", [length(BindVars)]); true -> ok end,
-    R = gen_server:call(PortPid, {port_call, [?EXEC_STMT, SessionId, StmtId, BindVars, NewAutoCommit]}, ?PORT_TIMEOUT),
+    R = gen_server:call(PortPid, PortCall([?EXEC_STMT, SessionId, StmtId, BindVars, NewAutoCommit]), ?PORT_TIMEOUT),
     ?DriverSleep,
     case R of
+        % batch row errors, offsets are mapped back to the position in BindVars
+        % (each group is sent to the port reversed, see split_binds/4)
+        {error, Errors} when is_list(Errors) ->
+            {error, [{Start + length(BindVars) - 1 - Off, Code, Msg} || {Off, Code, Msg} <- Errors]};
         {error, Error}  -> {error, Error};
         {cols, Clms}    -> collect_grouped_bind_request( GroupedBindVars, PortPid, SessionId, StmtId, AutoCommit
-                                                       , [{cols, [{N,?CS(T),Sz,P,Sc} || {N,T,Sz,P,Sc} <- Clms]} | Acc]);
+                                                       , Start + length(BindVars)
+                                                       , [{cols, [{N,?CS(T),Sz,P,Sc} || {N,T,Sz,P,Sc} <- Clms]} | Acc], PortCall);
         {executed, _} -> R;
         {executed, C, OutVars} ->
             {executed, C, [
@@ -206,7 +243,8 @@ collect_grouped_bind_request([BindVars|GroupedBindVars], PortPid, SessionId, Stm
                     Other -> Other
                 end
              || OV <- OutVars]};
-        R               -> collect_grouped_bind_request(GroupedBindVars, PortPid, SessionId, StmtId, AutoCommit, [R | Acc])
+        R               -> collect_grouped_bind_request(GroupedBindVars, PortPid, SessionId, StmtId, AutoCommit
+                                                       , Start + length(BindVars), [R | Acc], PortCall)
     end.
 
 split_binds(BindVars,MaxReqSize)    -> split_binds(BindVars, MaxReqSize, length(BindVars), []).
@@ -225,10 +263,25 @@ split_binds(BindVars, MaxReqSize, At, Acc) when is_list(BindVars) ->
             split_binds(Tail, MaxReqSize, length(Tail), [lists:reverse(Head)|Acc])
     end.
 
-fetch_rows(Count, {?MODULE, statement, PortPid, SessionId, StmtId}) ->
-    case gen_server:call(PortPid, {port_call, [?FTCH_ROWS, SessionId, StmtId, Count]}, ?PORT_TIMEOUT) of
+fetch_rows(Count, {?MODULE, statement, _PortPid, _SessionId, _StmtId} = Stmt) ->
+    case fetch_rows(Count, [stats], Stmt) of
         %%{{rows, Rows}, Completed} -> {{rows, lists:reverse(Rows)}, Completed};
-        {{rows, Rows}, Completed} -> {{rows, Rows}, Completed};
+        {{rows, Rows}, Completed, _Fetched} -> {{rows, Rows}, Completed};
+        Other -> Other
+    end.
+
+%% Count is an upper bound, the port may return fewer rows to stay within
+%% the response byte budget and fetch latency target. With [stats] the rows
+%% and bytes actually delivered are added as {fetched, Rows, Bytes},
+%% {deadline, Ms} overrides the deadline of the port.
+fetch_rows(Count, Opts, {?MODULE, statement, PortPid, SessionId, StmtId}) ->
+    PortCall = port_call(Opts),
+    case gen_server:call(PortPid, PortCall([?FTCH_ROWS, SessionId, StmtId, Count]), ?PORT_TIMEOUT) of
+        {{rows, Rows}, Completed, Fetched} ->
+            case lists:member(stats, Opts) of
+                true -> {{rows, Rows}, Completed, Fetched};
+                false -> {{rows, Rows}, Completed}
+            end;
         Other -> Other
     end.
 
@@ -296,7 +349,11 @@ start_exe(Executable, Logging, ListenPort, PortLogger, Options) ->
                   , use_stdio
                   , {args, [ integer_to_list(?MAX_REQ_SIZE)
                            , "true"
-                           , integer_to_list(ListenPort)]}
+                           , integer_to_list(ListenPort)
+                           | session_pool_args(Options) ++ stmt_cache_args(Options)
+                             ++ fetch_latency_args(Options) ++ control_lane_args(Options)
+                             ++ worker_args(Options) ++ queue_args(Options)
+                             ++ nonblocking_args(Options)]}
                   , {env, [{LibPath, NewLibPath}|Envs]}
                   ],
     ?Debug(PortLogger, "Executable ~p", [Executable]),
@@ -312,14 +369,72 @@ start_exe(Executable, Logging, ListenPort, PortLogger, Options) ->
                 true ->
                     port_command(Port, term_to_binary({undefined, ?RMOTE_MSG, ?DBG_FLAG_ON})),
                     ?Debug(PortLogger, "started log enabled new port:~n~p", [erlang:port_info(Port)]),
-                    {ok, #state{port=Port, logging=?DBG_FLAG_ON, logger=PortLogger}};
+                    {ok, #state{port=Port, logging=?DBG_FLAG_ON, logger=PortLogger, deadline=deadline(Options)}};
                 false ->
                     port_command(Port, term_to_binary({undefined, ?RMOTE_MSG, ?DBG_FLAG_OFF})),
                     ?Debug(PortLogger, "started log disabled new port:~n~p", [erlang:port_info(Port)]),
-                    {ok, #state{port=Port, logging=?DBG_FLAG_OFF, logger=PortLogger}}
+                    {ok, #state{port=Port, logging=?DBG_FLAG_OFF, logger=PortLogger, deadline=deadline(Options)}}
             end
     end.
 
+%% {session_pool, false} | {session_pool, [{min, N}, {max, N}, {incr, N}]}
+session_pool_args(Options) ->
+    case proplists:get_value(session_pool, Options, []) of
+        false -> ["spool_max=0"];
+        Pool when is_list(Pool) ->
+            [lists:flatten(io_lib:format("spool_~p=~p", [K, V]))
+             || {K, V} <- Pool, lists:member(K, [min, max, incr]), is_integer(V), V >= 0]
+    end.
+
+%% {stmt_cache_size, N}, 0 disables statement caching
+stmt_cache_args(Options) ->
+    case proplists:get_value(stmt_cache_size, Options) of
+        N when is_integer(N), N >= 0 -> ["stmt_cache="++integer_to_list(N)];
+        _ -> []
+    end.
+
+%% {workers, N} started with the port (default one per CPU),
+%% {max_workers, N} while workers are blocked in OCI calls
+worker_args(Options) ->
+    [lists:flatten(io_lib:format("~p=~p", [K, V]))
+     || {K, V} <- Options, lists:member(K, [workers, max_workers]), is_integer(V), V > 0].
+
+%% {queue_max, N} commands and {queue_max_bytes, N} waiting for a worker,
+%% beyond them requests are answered with {error, overloaded}
+queue_args(Options) ->
+    [lists:flatten(io_lib:format("~p=~p", [K, V]))
+     || {K, V} <- Options, lists:member(K, [queue_max, queue_max_bytes]), is_integer(V), V >= 0].
+
+%% {nonblocking_poll_ms, N}, executes and fetches of the sessions run
+%% non-blocking, a statement still executing is issued again after N ms
+nonblocking_args(Options) ->
+    case proplists:get_value(nonblocking_poll_ms, Options) of
+        N when is_integer(N), N > 0 -> ["nonblocking="++integer_to_list(N)];
+        _ -> []
+    end.
+
+%% {control_lane, [{workers, N}, {weight, N}]}, workers reserved for
+%% ping, commit, rollback and close, weight of those over heavy commands
+control_lane_args(Options) ->
+    Lane = proplists:get_value(control_lane, Options, []),
+    [lists:flatten(io_lib:format("ctl_~p=~p", [K, V]))
+     || {K, V} <- Lane, lists:member(K, [workers, weight]), is_integer(V), V >= 0].
+
+%% {fetch_latency_ms, N}, 0 bounds fetch_rows by row count and bytes only
+fetch_latency_args(Options) ->
+    case proplists:get_value(fetch_latency_ms, Options) of
+        N when is_integer(N), N >= 0 -> ["fetch_latency="++integer_to_list(N)];
+        _ -> []
+    end.
+
+%% {deadline_ms, N} for every command, commands still waiting then are
+%% answered with {error, timeout}, running exec_stmt and fetch_rows interrupted
+deadline(Options) ->
+    case proplists:get_value(deadline_ms, Options) of
+        N when is_integer(N), N >= 0 -> N;
+        _ -> infinity
+    end.
+
 -ifdef(WITH_VALGRIND).
 portstart(Executable, PortOptions) ->
     Args = proplists:get_value(args, PortOptions),
@@ -341,10 +456,15 @@ handle_call(close, _From, #state{port=Port} = State) ->
     end,
     erloci:del(self()),
     {reply, ok, State};
-handle_call({port_call, Msg}, From, #state{port=Port, logger=_PortLogger} = State) ->
+handle_call({port_call, Msg}, From, #state{deadline=Deadline} = State) ->
+    handle_call({port_call, Msg, Deadline}, From, State);
+handle_call({port_call, Msg, Deadline}, From, #state{port=Port, logger=_PortLogger} = State) ->
     Cmd = [if From /= undefined -> term_to_binary(From); true -> From end | Msg],
     CmdTuple = list_to_tuple(Cmd),
-    BTerm = term_to_binary(CmdTuple),
+    % the port drops or interrupts the command once Deadline ms passed
+    BTerm = term_to_binary(if is_integer(Deadline) -> {deadline, Deadline, CmdTuple};
+                              true -> CmdTuple
+                           end),
     %?Debug(_PortLogger, "TX (~p):~n---~n~p~n---~n~w~n---", [byte_size(BTerm), Cmd, BTerm]),
     %?Debug(_PortLogger, "TX (~p):~n---~n~p~n---~n~s~n---", [byte_size(BTerm), Cmd, oci_logger:bin2str(BTerm)]),
     %?Debug(_PortLogger, "TX (~p)", [integer_to_list(byte_size(BTerm),16)]),
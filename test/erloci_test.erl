@@ -89,8 +89,12 @@ db_negative_test_() ->
         end,
         {with, [
             fun echo/1,
+            fun split_frames/1,
             fun bad_password/1,
-            fun session_ping/1
+            fun session_ping/1,
+            fun overloaded/1,
+            fun nonblocking/1,
+            fun pool_overflow/1
         ]}
     }}.
 
@@ -122,6 +126,22 @@ echo(OciPort) ->
     ?assertEqual([1, atom, 1.2,"string"], OciPort:echo([1,atom,1.2,"string"])).
 
 
+split_frames(OciPort) ->
+    ?ELog("+---------------------------------------------+"),
+    ?ELog("|                 split_frames                |"),
+    ?ELog("+---------------------------------------------+"),
+    ?ELog("pipelined frames across the 64KB read chunk", []),
+    Self = self(),
+    % frame sizes around the chunk, their headers end up split between reads
+    Bins = [binary:copy(<<I>>, Size)
+            || {I, Size} <- lists:zip(lists:seq(1, 64),
+                                      [65536 - 32 + N || N <- lists:seq(1, 32)]
+                                      ++ lists:seq(1, 32))],
+    [spawn(fun() -> Self ! {split_echo, Bin, OciPort:echo(Bin)} end) || Bin <- Bins],
+    [receive {split_echo, Bin, Echo} -> ?assertEqual(Bin, Echo) after 10000 -> ?assertEqual(echo, timeout) end
+     || Bin <- Bins],
+    ?assertEqual(1, OciPort:echo(1)).
+
 bad_password(OciPort) ->
     ?ELog("+---------------------------------------------+"),
     ?ELog("|                 bad_password                |"),
@@ -132,6 +152,51 @@ bad_password(OciPort) ->
        {error, {1017,_}},
        OciPort:get_session(Tns, User, list_to_binary([Pswd,"_bad"]))).
 
+overloaded(_OciPort) ->
+    ?ELog("+---------------------------------------------+"),
+    ?ELog("|                  overloaded                 |"),
+    ?ELog("+---------------------------------------------+"),
+    {Tns,User,Pswd} = ?CONN_CONF,
+    FullPort = erloci:new([{logging, true}, {queue_max, 0}]),
+    ?assertEqual({error, overloaded}, FullPort:get_session(Tns, User, Pswd)),
+    % control commands still pass
+    ?assertEqual(1, FullPort:echo(1)),
+    ?assertEqual(1, proplists:get_value(overloaded, FullPort:stats())),
+    FullPort:close().
+
+nonblocking(_OciPort) ->
+    ?ELog("+---------------------------------------------+"),
+    ?ELog("|                 nonblocking                 |"),
+    ?ELog("+---------------------------------------------+"),
+    {Tns,User,Pswd} = ?CONN_CONF,
+    NbPort = erloci:new([{logging, true}, {nonblocking_poll_ms, 1}, {workers, 1}, {max_workers, 1}]),
+    Sessions = [NbPort:get_session(Tns, User, Pswd) || _ <- lists:seq(1,4)],
+    Self = self(),
+    % more statements in flight than workers
+    [spawn(fun() ->
+        SelStmt = OciSession:prep_sql(<<"select to_char(count(*)) from dual connect by level <= 200000">>),
+        {cols, _} = SelStmt:exec_stmt(),
+        Self ! {nb_rows, SelStmt:fetch_rows(10)}
+     end) || OciSession <- Sessions],
+    [receive {nb_rows, R} -> ?assertEqual({{rows,[[<<"200000">>]]},true}, R) after 60000 -> ?assertEqual(rows, timeout) end
+     || _ <- Sessions],
+    ?assertEqual(0, proplists:get_value(parked, NbPort:stats())),
+    NbPort:close().
+
+pool_overflow(_OciPort) ->
+    ?ELog("+---------------------------------------------+"),
+    ?ELog("|                pool_overflow                |"),
+    ?ELog("+---------------------------------------------+"),
+    {Tns,User,Pswd} = ?CONN_CONF,
+    PoolPort = erloci:new([{logging, true}, {session_pool, [{min, 1}, {max, 2}, {incr, 1}]}]),
+    ?assertEqual(ok, PoolPort:warm_pool(Tns, User, Pswd)),
+    % sessions beyond max are dedicated ones
+    Sessions = [PoolPort:get_session(Tns, User, Pswd) || _ <- lists:seq(1,4)],
+    [?assertMatch({?PORT_MODULE, _, _}, S) || S <- Sessions],
+    [?assertEqual(ok, S:ping()) || S <- Sessions],
+    [?assertEqual(ok, S:close()) || S <- Sessions],
+    PoolPort:close().
+
 session_ping(OciPort) ->
     ?ELog("+---------------------------------------------+"),
     ?ELog("|                 session_ping                |"),
@@ -171,7 +236,13 @@ db_test_() ->
        {with,
         [fun drop_create/1,
          fun bad_sql_connection_reuse/1,
+         fun stmt_cache_test/1,
+         fun fetch_stats_test/1,
+         fun control_lane_test/1,
+         fun cancel_test/1,
+         fun deadline_test/1,
          fun insert_select_update/1,
+         fun bind_too_long_test/1,
          fun auto_rollback_test/1,
          fun commit_rollback_test/1,
          fun asc_desc_test/1,
@@ -332,6 +403,128 @@ bad_sql_connection_reuse({_, OciSession}) ->
     ?assertEqual({{rows, [[<<"abc">>]]}, true}, SelStmt:fetch_rows(2)),
     ?assertEqual(ok, SelStmt:close()).
 
+stmt_cache_test({OciPort, OciSession}) ->
+    ?ELog("+---------------------------------------------+"),
+    ?ELog("|               stmt_cache_test               |"),
+    ?ELog("+---------------------------------------------+"),
+    Select = <<"select 'cached' from dual">>,
+    Stats0 = OciPort:stats(),
+    [begin
+         SelStmt = OciSession:prep_sql(Select),
+         ?assertMatch({cols, _}, SelStmt:exec_stmt()),
+         ?assertEqual({{rows, [[<<"cached">>]]}, true}, SelStmt:fetch_rows(2)),
+         ?assertEqual(ok, SelStmt:close())
+     end || _ <- lists:seq(1, 3)],
+    Stats1 = OciPort:stats(),
+    Hits = proplists:get_value(stmt_cache_hits, Stats1) - proplists:get_value(stmt_cache_hits, Stats0),
+    Misses = proplists:get_value(stmt_cache_misses, Stats1) - proplists:get_value(stmt_cache_misses, Stats0),
+    ?assertEqual({2, 1}, {Hits, Misses}).
+
+fetch_stats_test({_, OciSession}) ->
+    ?ELog("+---------------------------------------------+"),
+    ?ELog("|               fetch_stats_test              |"),
+    ?ELog("+---------------------------------------------+"),
+    SelStmt = OciSession:prep_sql(<<"select level from dual connect by level <= 250">>),
+    ?assertMatch({cols, _}, SelStmt:exec_stmt()),
+    ?assertEqual(250, fetch_all_counted(SelStmt, 0)),
+    ?assertEqual(ok, SelStmt:close()).
+
+control_lane_test(_) ->
+    ?ELog("+---------------------------------------------+"),
+    ?ELog("|              control_lane_test              |"),
+    ?ELog("+---------------------------------------------+"),
+    {Tns,User,Pswd} = ?CONN_CONF,
+    CtlPort = erloci:new([{logging, true}, {workers, 1}, {max_workers, 1}]),
+    BusySession = CtlPort:get_session(Tns, User, Pswd),
+    PingSession = CtlPort:get_session(Tns, User, Pswd),
+    LoopStmt = BusySession:prep_sql(<<"declare n number := 0; begin for i in 1..1000000000 loop n := n + 1; end loop; end;">>),
+    Self = self(),
+    spawn(fun() -> Self ! {loop_result, LoopStmt:exec_stmt()} end),
+    % the only general worker is busy in the loop
+    timer:sleep(500),
+    Stats0 = CtlPort:stats(),
+    ?assertEqual(ok, PingSession:ping()),
+    Stats1 = CtlPort:stats(),
+    % the ping and the second stats, both served by the control workers
+    ?assertEqual(2, proplists:get_value(ctl_lane_cmds, Stats1) - proplists:get_value(ctl_lane_cmds, Stats0)),
+    % still running, so the ping did not wait for the worker
+    ?assertEqual(ok, cancel_running(LoopStmt, 50)),
+    receive
+        {loop_result, Result} -> ?assertEqual({error, cancelled}, Result)
+    after 10000 ->
+        ?assertEqual({error, cancelled}, timeout)
+    end,
+    CtlPort:close().
+
+cancel_test({_, OciSession}) ->
+    ?ELog("+---------------------------------------------+"),
+    ?ELog("|                 cancel_test                 |"),
+    ?ELog("+---------------------------------------------+"),
+    ?assertEqual({error, not_running}, OciSession:cancel()),
+    LoopStmt = OciSession:prep_sql(<<"declare n number := 0; begin for i in 1..1000000000 loop n := n + 1; end loop; end;">>),
+    ?assertMatch({?PORT_MODULE, statement, _, _, _}, LoopStmt),
+    Self = self(),
+    spawn(fun() -> Self ! {loop_result, LoopStmt:exec_stmt()} end),
+    ?assertEqual(ok, cancel_running(LoopStmt, 50)),
+    receive
+        {loop_result, Result} -> ?assertEqual({error, cancelled}, Result)
+    after 10000 ->
+        ?assertEqual({error, cancelled}, timeout)
+    end,
+    ?assertEqual(ok, OciSession:ping()),
+    ?assertEqual(ok, LoopStmt:close()).
+
+deadline_test({OciPort, OciSession}) ->
+    ?ELog("+---------------------------------------------+"),
+    ?ELog("|                deadline_test                |"),
+    ?ELog("+---------------------------------------------+"),
+    LoopStmt = OciSession:prep_sql(<<"declare n number := 0; begin for i in 1..1000000000 loop n := n + 1; end loop; end;">>),
+    ?assertMatch({?PORT_MODULE, statement, _, _, _}, LoopStmt),
+    ?assertEqual({error, timeout}, LoopStmt:exec_stmt([], 1, [{deadline, 500}])),
+    ?assertEqual(ok, OciSession:ping()),
+    % a command waiting behind the busy session past its deadline never runs
+    Expired0 = proplists:get_value(expired, OciPort:stats()),
+    SelStmt = OciSession:prep_sql(<<"select * from dual">>),
+    Self = self(),
+    spawn(fun() -> Self ! {loop_result, LoopStmt:exec_stmt()} end),
+    timer:sleep(500),
+    spawn(fun() -> Self ! {queued_result, SelStmt:exec_stmt([], 1, [{deadline, 100}])} end),
+    timer:sleep(500),
+    ?assertEqual(ok, cancel_running(LoopStmt, 50)),
+    receive
+        {loop_result, LoopResult} -> ?assertEqual({error, cancelled}, LoopResult)
+    after 10000 ->
+        ?assertEqual({error, cancelled}, timeout)
+    end,
+    receive
+        {queued_result, QueuedResult} -> ?assertEqual({error, timeout}, QueuedResult)
+    after 10000 ->
+        ?assertEqual({error, timeout}, timeout)
+    end,
+    ?assertEqual(Expired0 + 1, proplists:get_value(expired, OciPort:stats())),
+    ?assertEqual(ok, OciSession:ping()),
+    ?assertEqual(ok, SelStmt:close()),
+    ?assertEqual(ok, LoopStmt:close()).
+
+% the loop may not have reached the port yet
+cancel_running(_Stmt, 0) -> {error, not_running};
+cancel_running(Stmt, Tries) ->
+    case Stmt:cancel() of
+        {error, not_running} ->
+            timer:sleep(100),
+            cancel_running(Stmt, Tries - 1);
+        Result -> Result
+    end.
+
+fetch_all_counted(SelStmt, Total) ->
+    {{rows, Rows}, Done, {fetched, N, Bytes}} = SelStmt:fetch_rows(1000, [stats]),
+    ?assertEqual(length(Rows), N),
+    ?assert(N == 0 orelse Bytes > 0),
+    case Done of
+        true -> Total + N;
+        false -> fetch_all_counted(SelStmt, Total + N)
+    end.
+
 
 insert_select_update({_, OciSession}) ->
     ?ELog("+---------------------------------------------+"),
@@ -458,6 +651,28 @@ insert_select_update({_, OciSession}) ->
     )),
     ?assertEqual(ok, BoundUpdStmt:close()).
 
+bind_too_long_test({_, OciSession}) ->
+    ?ELog("+---------------------------------------------+"),
+    ?ELog("|              bind_too_long_test             |"),
+    ?ELog("+---------------------------------------------+"),
+    flush_table(OciSession),
+    BoundInsStmt = OciSession:prep_sql(?INSERT),
+    ?assertEqual(ok, BoundInsStmt:bind_vars(?BIND_LIST)),
+    % bind values are limited to 64KB
+    ?assertMatch({error, {0, _}}, BoundInsStmt:exec_stmt(
+        [{ 1                                                                                % pkey
+         , binary:copy(<<"p">>, 70000)                                                      % publisher
+         , 1.5                                                                              % rank
+         , 1.0                                                                              % hero
+         , <<"reality">>                                                                    % reality
+         , 1                                                                                % votes
+         , oci_util:edatetime_to_ora(erlang:now())                                          % createdate
+         , 1.0                                                                              % chapters
+         , 1                                                                                % votes_first_rank
+         }]
+    )),
+    ?assertEqual(ok, BoundInsStmt:close()).
+
 auto_rollback_test({_, OciSession}) ->
     ?ELog("+---------------------------------------------+"),
     ?ELog("|              auto_rollback_test             |"),
@@ -501,8 +716,8 @@ auto_rollback_test({_, OciSession}) ->
     BoundUpdStmtRes = BoundUpdStmt:bind_vars(?UPDATE_BIND_LIST),
     ?assertMatch(ok, BoundUpdStmtRes),
 
-    % Expected Invalid number Error (1722)
-    ?assertMatch({error,{1722,_}}, BoundUpdStmt:exec_stmt(
+    % Expected Invalid number Error (1722) for the last two rows
+    {error, BatchErrors} = BoundUpdStmt:exec_stmt(
         [{ I                                                                                % pkey 
          , list_to_binary(["_Publisher_",integer_to_list(I),"_"])                           % publisher
          , I+I/3                                                                            % rank
@@ -515,7 +730,9 @@ auto_rollback_test({_, OciSession}) ->
          , Key
          } || {Key, I} <- lists:zip(RowIDs, lists:seq(1, length(RowIDs)))]
         , 1
-    )),
+    ),
+    ?assertEqual([{RowCount-2, 1722}, {RowCount-1, 1722}],
+                 lists:sort([{Row, Code} || {Row, Code, _} <- BatchErrors])),
 
     ?ELog("testing rollback table ~s", [?TESTTABLE]),
     ?assertEqual({cols, Cols}, SelStmt:exec_stmt()),